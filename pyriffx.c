@@ -0,0 +1,383 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ */
+
+/*
+ * CPython bindings for the riffx stream scanner.
+ *
+ *   import riffx
+ *   with riffx.Package("audio_banks.pck") as pkg:
+ *       for s in pkg.scan(labels=True):
+ *           print(s.offset, s.length, s.byteorder, s.label)
+ *           process(s.data)     # memoryview into the package mapping
+ *
+ * A Package maps its input file read-only and exports it through the
+ * buffer protocol; the data member of each stream descriptor is a
+ * memoryview slice of that mapping, no stream data is ever copied.
+ * The scan itself runs with the GIL released, so several packages can
+ * be scanned in parallel from different threads.
+ *
+ */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <structmember.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "riffscan.h"
+
+
+typedef struct {
+    PyObject_HEAD
+    PyObject *path;
+    const uint8_t *map;
+    size_t size;
+    Py_ssize_t exports;     /* number of outstanding buffer exports */
+} Package;
+
+typedef struct {
+    riffscan_entry_t e;
+    char lab[RIFFSCAN_LABEL_MAX + 1];
+} Stream;
+
+static PyTypeObject StreamType;
+
+static PyStructSequence_Field stream_fields[] = {
+    { "offset", "offset of the stream in the package" },
+    { "length", "length of the stream in bytes" },
+    { "byteorder", "'RIFF' (little endian) or 'RIFX' (big endian)" },
+    { "label", "label extracted from the stream, or None" },
+    { "data", "read-only memoryview of the stream data" },
+    { NULL, NULL }
+};
+
+static PyStructSequence_Desc stream_desc = {
+    "riffx.Stream",
+    "Descriptor of a RIFF stream discovered in a package.",
+    stream_fields,
+    5,
+};
+
+
+static void Package_unmap(Package *self) {
+    if (self->map) {
+        munmap((void *)self->map, self->size);
+        self->map = NULL;
+        self->size = 0;
+    }
+}
+
+static int Package_init(Package *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = { "path", NULL };
+    PyObject *path = NULL, *bpath;
+    struct stat st;
+    int fd;
+    void *map = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", kwlist,
+                                     PyUnicode_FSConverter, &bpath))
+        return -1;
+    if (self->exports > 0) {
+        Py_DECREF(bpath);
+        PyErr_SetString(PyExc_BufferError, "package data is in use");
+        return -1;
+    }
+    Package_unmap(self);
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(PyBytes_AS_STRING(bpath), O_RDONLY);
+    if (fd >= 0) {
+        if (0 != fstat(fd, &st))
+            map = MAP_FAILED;
+        else if (!S_ISREG(st.st_mode)) {
+            errno = ENOTSUP;
+            map = MAP_FAILED;
+        }
+        else if (st.st_size > 0)
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            fd = -1;
+        }
+        else
+            close(fd);
+    }
+    Py_END_ALLOW_THREADS
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, bpath);
+        Py_DECREF(bpath);
+        return -1;
+    }
+    path = PyUnicode_DecodeFSDefaultAndSize(PyBytes_AS_STRING(bpath),
+                                            PyBytes_GET_SIZE(bpath));
+    Py_DECREF(bpath);
+    if (!path) {
+        if (map)
+            munmap(map, st.st_size);
+        return -1;
+    }
+    Py_XSETREF(self->path, path);
+    self->map = map;
+    self->size = map ? (size_t)st.st_size : 0;
+    return 0;
+}
+
+static void Package_dealloc(Package *self) {
+    Package_unmap(self);
+    Py_XDECREF(self->path);
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static int Package_getbuffer(Package *self, Py_buffer *view, int flags) {
+    static const uint8_t empty[1];
+    int rc;
+
+    rc = PyBuffer_FillInfo(view, (PyObject *)self,
+                           self->map ? (void *)self->map : (void *)empty,
+                           self->size, 1, flags);
+    if (rc == 0)
+        ++self->exports;
+    return rc;
+}
+
+static void Package_releasebuffer(Package *self, Py_buffer *view) {
+    (void)view;
+    --self->exports;
+}
+
+static PyBufferProcs Package_as_buffer = {
+    (getbufferproc)Package_getbuffer,
+    (releasebufferproc)Package_releasebuffer,
+};
+
+/*
+ * Run the scanner with the GIL released, collecting the discovered
+ * streams in a growing array.  Returns the number of streams, or -1
+ * if we ran out of memory.
+ */
+static Py_ssize_t scan_streams(const uint8_t *map, size_t size,
+                               int guess_length, size_t align, int labels,
+                               Stream **out) {
+    riffscan_t scan;
+    riffscan_entry_t e;
+    Stream *v = NULL, *t;
+    size_t n = 0, cap = 0;
+
+    riffscan_init(&scan, map, size);
+    scan.guess_length = guess_length;
+    scan.align = align;
+    while (riffscan_next(&scan, &e)) {
+        if (n == cap) {
+            cap = cap ? cap * 2 : 256;
+            t = realloc(v, cap * sizeof *v);
+            if (!t) {
+                free(v);
+                return -1;
+            }
+            v = t;
+        }
+        v[n].e = e;
+        *v[n].lab = '\0';
+        if (labels)
+            labl(map + e.offs, e.len, e.endianess, v[n].lab);
+        ++n;
+    }
+    *out = v;
+    return n;
+}
+
+static PyObject *Package_scan(Package *self, PyObject *args, PyObject *kwds) {
+    static char *kwlist[] = { "guess_length", "labels", "align", NULL };
+    int guess_length = 0, labels = 0;
+    PyObject *aligno = Py_None;
+    size_t align = 0;
+    Stream *v = NULL;
+    Py_ssize_t n, i;
+    PyObject *list = NULL, *mv = NULL;
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ppO", kwlist,
+                                     &guess_length, &labels, &aligno))
+        return NULL;
+    if (PyUnicode_Check(aligno)
+            && 0 == PyUnicode_CompareWithASCIIString(aligno, "auto"))
+        align = RIFFSCAN_ALIGN_AUTO;
+    else if (aligno != Py_None) {
+        align = PyLong_AsSize_t(aligno);
+        if (align == (size_t)-1 && PyErr_Occurred())
+            return NULL;
+    }
+    if (!self->path) {
+        PyErr_SetString(PyExc_ValueError, "package is closed");
+        return NULL;
+    }
+    /* Hold a buffer export while the GIL is released, so the mapping
+     * cannot be closed under our feet by another thread. */
+    ++self->exports;
+    Py_BEGIN_ALLOW_THREADS
+    n = scan_streams(self->map, self->size, guess_length, align, labels, &v);
+    Py_END_ALLOW_THREADS
+    --self->exports;
+    if (n < 0)
+        return PyErr_NoMemory();
+
+    list = PyList_New(n);
+    if (!list)
+        goto err;
+    mv = PyMemoryView_FromObject((PyObject *)self);
+    if (!mv)
+        goto err;
+    for (i = 0; i < n; ++i) {
+        const riffscan_entry_t *e = &v[i].e;
+        PyObject *s, *data, *lab;
+
+        s = PyStructSequence_New(&StreamType);
+        if (!s)
+            goto err;
+        PyList_SET_ITEM(list, i, s);
+        data = PySequence_GetSlice(mv, e->offs, e->offs + e->len);
+        if (!data)
+            goto err;
+        if (*v[i].lab) {
+            lab = PyUnicode_DecodeASCII(v[i].lab, strlen(v[i].lab), "replace");
+            if (!lab) {
+                Py_DECREF(data);
+                goto err;
+            }
+        }
+        else {
+            lab = Py_None;
+            Py_INCREF(lab);
+        }
+        PyStructSequence_SET_ITEM(s, 0, PyLong_FromSize_t(e->offs));
+        PyStructSequence_SET_ITEM(s, 1, PyLong_FromSize_t(e->len));
+        PyStructSequence_SET_ITEM(s, 2,
+                PyUnicode_FromString(e->endianess ? "RIFX" : "RIFF"));
+        PyStructSequence_SET_ITEM(s, 3, lab);
+        PyStructSequence_SET_ITEM(s, 4, data);
+        if (PyErr_Occurred())
+            goto err;
+    }
+    Py_DECREF(mv);
+    free(v);
+    return list;
+err:
+    Py_XDECREF(mv);
+    Py_XDECREF(list);
+    free(v);
+    return NULL;
+}
+
+static PyObject *Package_close(Package *self, PyObject *unused) {
+    (void)unused;
+    if (self->exports > 0) {
+        PyErr_SetString(PyExc_BufferError,
+                "cannot close package while stream data is in use");
+        return NULL;
+    }
+    Package_unmap(self);
+    Py_CLEAR(self->path);
+    Py_RETURN_NONE;
+}
+
+static PyObject *Package_enter(Package *self, PyObject *unused) {
+    (void)unused;
+    Py_INCREF(self);
+    return (PyObject *)self;
+}
+
+static PyObject *Package_exit(Package *self, PyObject *args) {
+    (void)args;
+    return Package_close(self, NULL);
+}
+
+static PyObject *Package_get_closed(Package *self, void *closure) {
+    (void)closure;
+    return PyBool_FromLong(!self->path);
+}
+
+static PyMethodDef Package_methods[] = {
+    { "scan", (PyCFunction)(void (*)(void))Package_scan,
+      METH_VARARGS | METH_KEYWORDS,
+      "scan(guess_length=False, labels=False, align=None) -> list of Stream\n\n"
+      "Locate RIFF streams in the package.  The GIL is released while\n"
+      "scanning.  With guess_length, size fields are ignored and each\n"
+      "stream is assumed to end where the next one begins.  With labels,\n"
+      "try to extract a label from each stream (unreliable!).  With align\n"
+      "set to N or 'auto', only look for streams at multiples of N bytes." },
+    { "close", (PyCFunction)Package_close, METH_NOARGS,
+      "Unmap the package.  Fails while stream data is still referenced." },
+    { "__enter__", (PyCFunction)Package_enter, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)Package_exit, METH_VARARGS, NULL },
+    { NULL, NULL, 0, NULL }
+};
+
+static PyMemberDef Package_members[] = {
+    { "path", T_OBJECT, offsetof(Package, path), READONLY,
+      "path of the package file" },
+    { "size", T_PYSSIZET, offsetof(Package, size), READONLY,
+      "size of the package in bytes" },
+    { NULL, 0, 0, 0, NULL }
+};
+
+static PyGetSetDef Package_getset[] = {
+    { "closed", (getter)Package_get_closed, NULL,
+      "True if the package has been closed", NULL },
+    { NULL, NULL, NULL, NULL, NULL }
+};
+
+static PyTypeObject PackageType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "riffx.Package",
+    .tp_doc = "Package(path)\n\nRead-only mapping of a file to scan for "
+              "RIFF streams.\nSupports the buffer protocol.",
+    .tp_basicsize = sizeof(Package),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = PyType_GenericNew,
+    .tp_init = (initproc)Package_init,
+    .tp_dealloc = (destructor)Package_dealloc,
+    .tp_as_buffer = &Package_as_buffer,
+    .tp_methods = Package_methods,
+    .tp_members = Package_members,
+    .tp_getset = Package_getset,
+};
+
+static struct PyModuleDef riffx_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "riffx",
+    .m_doc = "Zero-copy access to RIFF streams embedded in other files.",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_riffx(void) {
+    PyObject *m;
+
+    if (PyType_Ready(&PackageType) < 0)
+        return NULL;
+    if (PyStructSequence_InitType2(&StreamType, &stream_desc) < 0)
+        return NULL;
+    m = PyModule_Create(&riffx_module);
+    if (!m)
+        return NULL;
+    Py_INCREF(&PackageType);
+    if (PyModule_AddObject(m, "Package", (PyObject *)&PackageType) < 0)
+        goto err;
+    Py_INCREF(&StreamType);
+    if (PyModule_AddObject(m, "Stream", (PyObject *)&StreamType) < 0)
+        goto err;
+    return m;
+err:
+    Py_DECREF(m);
+    return NULL;
+}
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ *
+ * RIFF chunk walker, see riffchunk.h.
+ */
+
+#include <string.h>
+
+#include "riffchunk.h"
+
+
+#define FOURCC_IS(p_,q_) (!memcmp((const void *)(p_),(const void *)(q_),4))
+
+typedef struct {
+    const uint8_t *base;
+    const riffchunk_visitor_t *v;
+    int endianess;
+    int truncated;
+    /* From the ds64 chunk of RF64/BW64 forms: */
+    int have_ds64;
+    uint64_t riff_size, data_size;
+    const uint8_t *table;       /* entries of 12 bytes: ID, uint64 size */
+    uint32_t table_len;
+} walk_t;
+
+static int is_rf64(const void *fcc) {
+    return FOURCC_IS(fcc, "RF64") || FOURCC_IS(fcc, "BW64");
+}
+
+int riffchunk_form(const void *p, size_t len) {
+    if (len < 12)
+        return -1;
+    if (FOURCC_IS(p, "RIFF") || is_rf64(p))
+        return 0;
+    if (FOURCC_IS(p, "RIFX"))
+        return 1;
+    return -1;
+}
+
+/*
+ * Remember the sizes from the ds64 chunk, which must be the first chunk
+ * of an RF64 form, as we need them to know the size of the form itself.
+ */
+static void ds64_load(walk_t *w, const uint8_t *p, size_t len) {
+    const uint8_t *c = p + 12;
+    size_t avail;
+
+    if (len < 20 || !FOURCC_IS(p + 12, "ds64"))
+        return;
+    avail = riffchunk_u32(c + 4, 0);
+    if (avail > len - 20)
+        avail = len - 20;
+    if (avail < 24)
+        return;
+    c += 8;
+    w->have_ds64 = 1;
+    w->riff_size = riffchunk_u64(c, 0);
+    w->data_size = riffchunk_u64(c + 8, 0);
+    w->table_len = avail >= 28 ? riffchunk_u32(c + 24, 0) : 0;
+    if (w->table_len > (avail - 28) / 12)
+        w->table_len = 0;
+    w->table = c + 28;
+}
+
+/* Size of the chunk with ID fcc and size field sz, see ds64_load(): */
+static uint64_t chunk_size(const walk_t *w, const uint8_t *fcc, uint32_t sz,
+                           unsigned depth) {
+    if (sz != 0xFFFFFFFF || !w->have_ds64)
+        return sz;
+    if (depth == 0)
+        return w->riff_size;
+    if (FOURCC_IS(fcc, "data"))
+        return w->data_size;
+    for (uint32_t i = 0; i < w->table_len; ++i)
+        if (FOURCC_IS(fcc, w->table + i * 12))
+            return riffchunk_u64(w->table + i * 12 + 4, 0);
+    return sz;
+}
+
+/*
+ * Visit the chunks in [offs, end) of the buffer at the given depth.
+ * Returns RIFFCHUNK_NEXT, RIFFCHUNK_SKIP or a stop value.
+ */
+static int walk(walk_t *w, size_t offs, size_t end, unsigned depth) {
+    const riffchunk_visitor_t *v = w->v;
+    riffchunk_t c;
+    int r = RIFFCHUNK_NEXT;
+
+    while (end - offs >= 8) {
+        c.fcc = w->base + offs;
+        c.offs = offs;
+        c.size32 = riffchunk_u32(c.fcc + 4, w->endianess);
+        c.size = chunk_size(w, c.fcc, c.size32, depth);
+        c.data = c.fcc + 8;
+        c.len = end - offs - 8;
+        if (c.size < c.len)
+            c.len = (size_t)c.size;
+        else if (c.size > c.len)
+            w->truncated = 1;
+        c.depth = depth;
+        c.endianess = w->endianess;
+        if ((depth == 0 || FOURCC_IS(c.fcc, "LIST"))
+            && depth < RIFFCHUNK_MAX_DEPTH && c.len >= 4) {
+            r = v->enter ? v->enter(v->arg, &c) : RIFFCHUNK_NEXT;
+            if (r == RIFFCHUNK_NEXT)
+                r = walk(w, offs + 12, offs + 8 + c.len, depth + 1);
+            if (r != RIFFCHUNK_NEXT && r != RIFFCHUNK_SKIP)
+                return r;
+            r = v->leave ? v->leave(v->arg, &c) : RIFFCHUNK_NEXT;
+        }
+        else {
+            r = v->leaf ? v->leaf(v->arg, &c) : RIFFCHUNK_NEXT;
+        }
+        if (r != RIFFCHUNK_NEXT || depth == 0 || c.len < c.size)
+            break;
+        /* Chunks are padded to an even size: */
+        offs += 8 + c.len + (c.len & 1);
+        if (offs > end)
+            break;
+    }
+    return r;
+}
+
+int riffchunk_walk(const void *buf, size_t len, const riffchunk_visitor_t *v) {
+    walk_t w;
+    int r;
+
+    memset(&w, 0, sizeof w);
+    w.base = buf;
+    w.v = v;
+    w.endianess = riffchunk_form(buf, len);
+    if (w.endianess < 0)
+        return RIFFCHUNK_TRUNCATED;
+    if (is_rf64(buf))
+        ds64_load(&w, buf, len);
+    r = walk(&w, 0, len, 0);
+    if (r == RIFFCHUNK_NEXT || r == RIFFCHUNK_SKIP)
+        r = w.truncated ? RIFFCHUNK_TRUNCATED : RIFFCHUNK_NEXT;
+    return r;
+}
+
+#define FOUND 2
+
+typedef struct {
+    const char *fcc;
+    riffchunk_t *c;
+} find_t;
+
+static int find_leaf(void *arg, const riffchunk_t *c) {
+    find_t *f = arg;
+
+    if (!FOURCC_IS(c->fcc, f->fcc))
+        return RIFFCHUNK_NEXT;
+    *f->c = *c;
+    return FOUND;
+}
+
+int riffchunk_find(const void *buf, size_t len, const char *fcc, riffchunk_t *c) {
+    find_t f = { fcc, c };
+    riffchunk_visitor_t v = { find_leaf, NULL, find_leaf, &f };
+
+    return FOUND == riffchunk_walk(buf, len, &v) ? 0 : -1;
+}
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ *
+ * RIFF chunk walker, built as libriffchunk.a and shared by unriffle,
+ * riffx and its Python bindings.
+ *
+ * riffchunk_walk() visits the chunks of one RIFF/RIFX/RF64/BW64 form in
+ * a memory buffer, depth first, and hands each one to a visitor:
+ *
+ *   enter(arg, c)  for the form itself and each LIST chunk, before
+ *                  their children,
+ *   leave(arg, c)  for the same, after their children,
+ *   leaf(arg, c)   for every other chunk.
+ *
+ * Each callback may be NULL, and returns RIFFCHUNK_NEXT to go on,
+ * RIFFCHUNK_SKIP to skip the rest of the current container (from enter:
+ * its children, from leaf: its remaining siblings), or any other value
+ * to stop the walk, which then returns that value.
+ *
+ * The walker never reads outside the buffer and never allocates memory.
+ * Chunks are reported with their declared size and the part of their
+ * payload actually present, which is shorter for chunks exceeding their
+ * parent or the buffer; the walk then returns RIFFCHUNK_TRUNCATED once
+ * it is done.  Sizes of 0xFFFFFFFF in RF64/BW64 forms are looked up in
+ * the ds64 chunk.
+ *
+ * Usage:
+ *
+ *   static int leaf(void *arg, const riffchunk_t *c) {
+ *       if (!memcmp(c->fcc, "data", 4))
+ *           do_something(c->data, c->len);
+ *       return RIFFCHUNK_NEXT;
+ *   }
+ *
+ *   riffchunk_visitor_t v = { NULL, NULL, leaf, NULL };
+ *   riffchunk_walk(buf, len, &v);
+ *
+ * This file is C99, so it can be used by unriffle.
+ */
+
+#ifndef RIFFCHUNK_H_INCLUDED
+#define RIFFCHUNK_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* Callback results, see above: */
+#define RIFFCHUNK_NEXT          0
+#define RIFFCHUNK_SKIP          1
+/* Walk result for a form with chunks exceeding their parent: */
+#define RIFFCHUNK_TRUNCATED     (-1)
+
+/* Containers nested deeper than this are reported as leaves: */
+#define RIFFCHUNK_MAX_DEPTH     16
+
+typedef struct {
+    const uint8_t *fcc;     /* chunk ID, points into the buffer */
+    size_t offs;            /* offset of the chunk header in the buffer */
+    uint64_t size;          /* declared payload size, ds64 sizes resolved */
+    uint32_t size32;        /* the size field as found in the header */
+    const uint8_t *data;    /* payload; for containers the form type */
+    size_t len;             /* payload bytes present, at most size */
+    unsigned depth;         /* 0 for the form, 1 for its chunks, ... */
+    int endianess;          /* 0: RIFF, RF64, BW64; 1: RIFX */
+} riffchunk_t;
+
+typedef struct {
+    int (*enter)(void *arg, const riffchunk_t *c);
+    int (*leave)(void *arg, const riffchunk_t *c);
+    int (*leaf)(void *arg, const riffchunk_t *c);
+    void *arg;
+} riffchunk_visitor_t;
+
+/* Little/Big Endian to native conversion: */
+static inline uint16_t riffchunk_u16(const void *p, int endianess) {
+    const uint8_t *b = p;
+    if (!endianess)     /* Little Endian byte order (RIFF) */
+        return b[0] | b[1] << 8;
+    /* Big Endian byte order (RIFX) */
+    return b[1] | b[0] << 8;
+}
+
+static inline uint32_t riffchunk_u32(const void *p, int endianess) {
+    const uint8_t *b = p;
+    if (!endianess)     /* Little Endian byte order (RIFF) */
+        return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+    /* Big Endian byte order (RIFX) */
+    return b[3] | b[2] << 8 | b[1] << 16 | (uint32_t)b[0] << 24;
+}
+
+static inline uint64_t riffchunk_u64(const void *p, int endianess) {
+    const uint8_t *b = p;
+    if (!endianess)
+        return riffchunk_u32(b, 0) | (uint64_t)riffchunk_u32(b + 4, 0) << 32;
+    return riffchunk_u32(b + 4, 1) | (uint64_t)riffchunk_u32(b, 1) << 32;
+}
+
+/* Tell the byte order of the form at p, or -1 if it is none: */
+int riffchunk_form(const void *p, size_t len);
+
+/*
+ * Walk the form at the start of buf, len bytes long; bytes following
+ * it are ignored.  Returns RIFFCHUNK_NEXT (0) after a complete walk,
+ * RIFFCHUNK_TRUNCATED if chunks were cut short, the value a callback
+ * stopped the walk with, or RIFFCHUNK_TRUNCATED if there is no form.
+ */
+int riffchunk_walk(const void *buf, size_t len, const riffchunk_visitor_t *v);
+
+/*
+ * Find the first chunk with ID fcc in the form at the start of buf, in
+ * depth first order.  Returns 0 and fills in c if found, else -1.
+ */
+int riffchunk_find(const void *buf, size_t len, const char *fcc, riffchunk_t *c);
+
+#endif /* RIFFCHUNK_H_INCLUDED */
@@ -0,0 +1,265 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ *
+ * Stream index files, written by riffx --index and read by riffx --query.
+ *
+ * An index describes the streams found in a set of packages, so that
+ * questions like "which package holds the stream labelled X, or with
+ * content hash Y?" are answered without touching the packages.  It is
+ * meant to be mapped and used in place:
+ *
+ *   header      riffidx_header_t
+ *   packages    riffidx_package_t[npackages]
+ *   for each package:
+ *     streams   riffidx_stream_t[nstreams], in the order found
+ *     keys      riffidx_key_t[nkeys], sorted by key, see riffidx_key_cmp()
+ *     bloom     Bloom filter of the keys, bloom_bits bits
+ *   strings     null-terminated package names and stream labels
+ *
+ * Offsets are relative to the start of the file, string references to
+ * the start of the strings, and all sections are 8 byte aligned.  Numbers
+ * are stored in host byte order, which the bom field tells.
+ *
+ * Each stream has a key for its content hash, the XXH64 (seed 0) of its
+ * bytes, as printed by `xxhsum -H64` for the stream dumped as is, and one
+ * for its label, if any, the XXH64 of the label with RIFFIDX_LABEL_SEED.
+ * A lookup tests the Bloom filter of each package, which rules out most
+ * of them with a few memory accesses, and binary searches the keys of
+ * the others.
+ */
+
+#ifndef RIFFIDX_H_INCLUDED
+#define RIFFIDX_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+
+#define RIFFIDX_MAGIC           "RIFFXIDX"
+#define RIFFIDX_VERSION         1
+#define RIFFIDX_BOM             0x01020304
+#define RIFFIDX_LABEL_SEED      1
+#define RIFFIDX_NONE            UINT64_MAX
+/* Bloom filter size and probes, for about 1% false positives: */
+#define RIFFIDX_BLOOM_BITS_PER_KEY  10
+#define RIFFIDX_BLOOM_K             7
+
+enum { RIFFIDX_HASH, RIFFIDX_LABEL };
+
+typedef struct {
+    char magic[8];
+    uint32_t bom;
+    uint32_t version;
+    uint64_t npackages;
+    uint64_t packages;          /* offset of the package table */
+    uint64_t strings, strings_len;
+} riffidx_header_t;
+
+typedef struct {
+    uint64_t name;              /* string reference */
+    uint64_t size;              /* package size when indexed */
+    uint64_t streams, nstreams;
+    uint64_t keys, nkeys;
+    uint64_t bloom, bloom_bits; /* bloom_bits is a power of 2 */
+} riffidx_package_t;
+
+typedef struct {
+    uint64_t offs, len;         /* of the stream in the package */
+    uint64_t hash;              /* XXH64 of the stream */
+    uint64_t label;             /* string reference, or RIFFIDX_NONE */
+} riffidx_stream_t;
+
+typedef struct {
+    uint64_t key;
+    uint32_t stream;            /* index into the streams of the package */
+    uint32_t kind;              /* RIFFIDX_HASH or RIFFIDX_LABEL */
+} riffidx_key_t;
+
+
+/*
+ * XXH64, see https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md
+ */
+#define RIFFIDX_P1  0x9E3779B185EBCA87ULL
+#define RIFFIDX_P2  0xC2B2AE3D27D4EB4FULL
+#define RIFFIDX_P3  0x165667B19E3779F9ULL
+#define RIFFIDX_P4  0x85EBCA77C2B2AE63ULL
+#define RIFFIDX_P5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t riffidx_rotl(uint64_t x, int r) {
+    return x << r | x >> (64 - r);
+}
+
+static inline uint64_t riffidx_le64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof v);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static inline uint32_t riffidx_le32(const uint8_t *p) {
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static inline uint64_t riffidx_round(uint64_t acc, uint64_t in) {
+    return riffidx_rotl(acc + in * RIFFIDX_P2, 31) * RIFFIDX_P1;
+}
+
+static inline uint64_t riffidx_merge(uint64_t h, uint64_t v) {
+    return (h ^ riffidx_round(0, v)) * RIFFIDX_P1 + RIFFIDX_P4;
+}
+
+static inline uint64_t riffidx_xxh64(const void *buf, size_t len, uint64_t seed) {
+    const uint8_t *p = buf, *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + RIFFIDX_P1 + RIFFIDX_P2, v2 = seed + RIFFIDX_P2;
+        uint64_t v3 = seed, v4 = seed - RIFFIDX_P1;
+        for (; end - p >= 32; p += 32) {
+            v1 = riffidx_round(v1, riffidx_le64(p));
+            v2 = riffidx_round(v2, riffidx_le64(p + 8));
+            v3 = riffidx_round(v3, riffidx_le64(p + 16));
+            v4 = riffidx_round(v4, riffidx_le64(p + 24));
+        }
+        h = riffidx_rotl(v1, 1) + riffidx_rotl(v2, 7)
+            + riffidx_rotl(v3, 12) + riffidx_rotl(v4, 18);
+        h = riffidx_merge(h, v1);
+        h = riffidx_merge(h, v2);
+        h = riffidx_merge(h, v3);
+        h = riffidx_merge(h, v4);
+    }
+    else {
+        h = seed + RIFFIDX_P5;
+    }
+    h += len;
+    for (; end - p >= 8; p += 8)
+        h = riffidx_rotl(h ^ riffidx_round(0, riffidx_le64(p)), 27)
+            * RIFFIDX_P1 + RIFFIDX_P4;
+    if (end - p >= 4) {
+        h = riffidx_rotl(h ^ riffidx_le32(p) * RIFFIDX_P1, 23)
+            * RIFFIDX_P2 + RIFFIDX_P3;
+        p += 4;
+    }
+    for (; p < end; ++p)
+        h = riffidx_rotl(h ^ *p * RIFFIDX_P5, 11) * RIFFIDX_P1;
+    h ^= h >> 33;
+    h *= RIFFIDX_P2;
+    h ^= h >> 29;
+    h *= RIFFIDX_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t riffidx_label_key(const char *label) {
+    return riffidx_xxh64(label, strlen(label), RIFFIDX_LABEL_SEED);
+}
+
+/* Order of the keys of a package: */
+static inline int riffidx_key_cmp(const void *a, const void *b) {
+    const riffidx_key_t *x = a, *y = b;
+    if (x->key != y->key)
+        return x->key < y->key ? -1 : 1;
+    if (x->kind != y->kind)
+        return x->kind < y->kind ? -1 : 1;
+    return x->stream < y->stream ? -1 : x->stream > y->stream;
+}
+
+/* Bloom filter size in bits for n keys, a power of 2 of 64 or more: */
+static inline uint64_t riffidx_bloom_bits(uint64_t n) {
+    uint64_t bits = 64;
+    while (bits < n * RIFFIDX_BLOOM_BITS_PER_KEY)
+        bits *= 2;
+    return bits;
+}
+
+/* The probes for key are h1 + i * h2, by double hashing: */
+static inline void riffidx_bloom_add(uint8_t *bloom, uint64_t bits, uint64_t key) {
+    uint64_t h2 = (key >> 32 | key << 32) | 1;
+    for (int i = 0; i < RIFFIDX_BLOOM_K; ++i, key += h2)
+        bloom[(key & (bits - 1)) / 8] |= 1 << (key & 7);
+}
+
+static inline int riffidx_bloom_test(const uint8_t *bloom, uint64_t bits, uint64_t key) {
+    uint64_t h2 = (key >> 32 | key << 32) | 1;
+    for (int i = 0; i < RIFFIDX_BLOOM_K; ++i, key += h2)
+        if (!(bloom[(key & (bits - 1)) / 8] & 1 << (key & 7)))
+            return 0;
+    return 1;
+}
+
+/*
+ * Check the index map of len bytes, so that riffidx_package() and
+ * riffidx_string() can be used without further bounds checks.
+ * Returns its header, or NULL if it is not a valid index.
+ */
+static inline const riffidx_header_t *riffidx_open(const void *map, size_t len) {
+    const riffidx_header_t *h = map;
+    const riffidx_package_t *p;
+
+    if (len < sizeof *h || memcmp(h->magic, RIFFIDX_MAGIC, 8)
+        || h->bom != RIFFIDX_BOM || h->version != RIFFIDX_VERSION
+        || h->packages > len || h->packages % 8
+        || h->npackages > (len - h->packages) / sizeof *p
+        || h->strings > len || h->strings_len > len - h->strings
+        || !h->strings_len || ((const char *)map)[h->strings + h->strings_len - 1])
+        return NULL;
+    p = (const riffidx_package_t *)((const uint8_t *)map + h->packages);
+    for (uint64_t i = 0; i < h->npackages; ++i, ++p) {
+        if (p->name >= h->strings_len
+            || p->streams > len || p->streams % 8
+            || p->nstreams > (len - p->streams) / sizeof(riffidx_stream_t)
+            || p->keys > len || p->keys % 8
+            || p->nkeys > (len - p->keys) / sizeof(riffidx_key_t)
+            || p->bloom > len || p->bloom_bits < 64
+            || (p->bloom_bits & (p->bloom_bits - 1))
+            || p->bloom_bits / 8 > len - p->bloom)
+            return NULL;
+    }
+    return h;
+}
+
+static inline const riffidx_package_t *riffidx_package(const riffidx_header_t *h,
+                                                       uint64_t i) {
+    return (const riffidx_package_t *)((const uint8_t *)h + h->packages) + i;
+}
+
+/* String reference s, or "" for a bad one: */
+static inline const char *riffidx_string(const riffidx_header_t *h, uint64_t s) {
+    return s < h->strings_len ? (const char *)h + h->strings + s : "";
+}
+
+/*
+ * Find the streams of package p with the given key and kind.  Returns
+ * the number of them, and the first of their keys in *first.
+ */
+static inline size_t riffidx_find(const riffidx_header_t *h, const riffidx_package_t *p,
+                                  uint64_t key, uint32_t kind,
+                                  const riffidx_key_t **first) {
+    const uint8_t *base = (const uint8_t *)h;
+    const riffidx_key_t *k = (const riffidx_key_t *)(base + p->keys);
+    riffidx_key_t want = { key, 0, kind };
+    size_t lo = 0, hi = p->nkeys, n;
+
+    if (!riffidx_bloom_test(base + p->bloom, p->bloom_bits, key))
+        return 0;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (riffidx_key_cmp(&k[mid], &want) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    for (n = 0; lo + n < p->nkeys && k[lo + n].key == key
+                && k[lo + n].kind == kind; ++n)
+        ;
+    *first = k + lo;
+    return n;
+}
+
+#endif /* RIFFIDX_H_INCLUDED */
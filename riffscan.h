@@ -0,0 +1,454 @@
+/*
+ * Copyright (c) 2019 volpol, Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ *
+ * RIFF stream scanner shared by riffx and its Python bindings.  Needs
+ * libriffchunk.a, for labl().
+ *
+ * Locate anything that looks remotely like a RIFF/RIFX stream, or one
+ * of its 64 bit variants RF64/BW64, in a memory buffer.  The scanner
+ * keeps all of its state in a riffscan_t object and does not allocate
+ * any memory, so separate buffers can be scanned concurrently from
+ * different threads.
+ *
+ * Runs of zero bytes, e.g. container padding, are skipped in blocks of
+ * 64 bytes, and known holes of sparse files are not touched at all.
+ *
+ * Usage:
+ *
+ *   riffscan_t s;
+ *   riffscan_entry_t e;
+ *
+ *   riffscan_init(&s, buf, len);
+ *   s.guess_length = 1;            (optional settings, see riffscan_t)
+ *   while (riffscan_next(&s, &e))
+ *       do_something(buf + e.offs, e.len);
+ *
+ */
+
+#ifndef RIFFSCAN_H_INCLUDED
+#define RIFFSCAN_H_INCLUDED
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "riffchunk.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+/* Maximum length of a stream label, excluding the terminating null: */
+#define RIFFSCAN_LABEL_MAX  200
+
+/* Infer the alignment from the offsets of the first few streams: */
+#define RIFFSCAN_ALIGN_AUTO     ((size_t)-1)
+#define RIFFSCAN_AUTO_HITS      8
+#define RIFFSCAN_AUTO_MIN       16
+#define RIFFSCAN_AUTO_MAX       4096
+
+/* Granularity of progress reports, in bytes scanned: */
+#define RIFFSCAN_CHUNK          (1 << 20)
+
+typedef struct {
+    size_t offs;        /* offset of the stream in the scanned buffer */
+    size_t len;         /* length of the stream */
+    int endianess;      /* 0: RIFF (little endian), 1: RIFX (big endian) */
+} riffscan_entry_t;
+
+typedef struct {
+    size_t start;       /* offset of first byte in range */
+    size_t end;         /* offset of first byte past range */
+} riffscan_range_t;
+
+/*
+ * Settings, may be changed after riffscan_init() but before the first
+ * call to riffscan_next():
+ *
+ * guess_length:
+ * 0: read the stream length from the RIFF header size field
+ * 1: assume the stream ends at the beginning of the next (or EOF)
+ *
+ * align:
+ * 0, 1: test for a stream signature at every byte offset
+ * N: only test at offsets that are a multiple of N, except where the
+ *    chain of streams breaks, see riffscan_find()
+ * RIFFSCAN_ALIGN_AUTO: scan every offset until RIFFSCAN_AUTO_HITS
+ *    streams were found, then use the largest power of two that evenly
+ *    divides all of their offsets, if it is at least RIFFSCAN_AUTO_MIN
+ *
+ * start, limit:
+ * Only report streams starting at an offset in [start, limit), limit 0
+ * meaning the end of the buffer.  Streams starting in that range may
+ * well extend past its end, and with guess_length set the buffer is
+ * searched past limit for the beginning of the next stream.
+ *
+ * holes, nholes:
+ * Sorted array of ranges known to read as all zero bytes, e.g. holes in
+ * a sparse file, which are skipped without touching them.  The array is
+ * owned by the caller and must stay valid during the scan.
+ *
+ * skip_inner:
+ * 0: continue searching right after the start of each stream, so that
+ *    streams nested inside other streams are reported, too
+ * 1: continue searching after the end of each stream (as given by its
+ *    size field), for carving nested streams separately
+ *
+ * progress, progress_arg:
+ * If set, progress(progress_arg, n) is called whenever the scanner is
+ * about to look at the next n bytes of the buffer, roughly every
+ * RIFFSCAN_CHUNK bytes.  Holes and runs of zero bytes skipped are not
+ * counted.  Used e.g. to throttle or meter input.
+ */
+typedef struct {
+    const uint8_t *base;    /* the scanned buffer */
+    size_t size;            /* its size */
+    int guess_length;
+    size_t align;
+    size_t start, limit;
+    int skip_inner;
+    const riffscan_range_t *holes;
+    size_t nholes;
+    void (*progress)(void *arg, size_t n);
+    void *progress_arg;
+    /* Internal state: */
+    int started;            /* first stream was located */
+    const uint8_t *cur;     /* next stream to report, or NULL */
+    const uint8_t *chain;   /* expected end of the last stream, or NULL */
+    int endianess;          /* byte order of streams found in buffer */
+    size_t auto_cnt;        /* streams seen while inferring alignment */
+    size_t auto_bits;       /* OR of their offsets */
+} riffscan_t;
+
+
+/*
+ * Stream signatures by byte order.  RF64 (EBU Tech 3306) and BW64
+ * (ITU-R BS.2088) are the little endian 64 bit variants of RIFF.
+ */
+static const char *const riffscan_sigs[2][4] = {
+    { "RIFF", "RF64", "BW64", NULL },
+    { "RIFX", NULL, NULL, NULL },
+};
+
+/* Test whether p points to one of the signatures in the set sigs: */
+static inline int riffscan_is_sig(const uint8_t *p, const char *const *sigs) {
+    for (; *sigs; ++sigs)
+        if (!memcmp(p, *sigs, 4))
+            return 1;
+    return 0;
+}
+
+/*
+ * Return the length of the stream starting at p, remsize bytes before
+ * the end of the buffer, as declared by its header, or UINT64_MAX if
+ * that does not fit in a size_t.  RF64 and BW64 streams larger than
+ * 4 GiB store a size of 0xFFFFFFFF in the header and the actual size in
+ * the ds64 chunk that must follow the form type.
+ */
+static inline uint64_t riffscan_len(const uint8_t *p, size_t remsize, int endianess) {
+    uint32_t sz = riffchunk_u32(p + 4, endianess);
+    uint64_t sz64;
+
+    if (sz == 0xFFFFFFFF && remsize >= 28 && !endianess
+            && (!memcmp(p, "RF64", 4) || !memcmp(p, "BW64", 4))
+            && !memcmp(p + 12, "ds64", 4)) {
+        sz64 = riffchunk_u32(p + 20, 0) | (uint64_t)riffchunk_u32(p + 24, 0) << 32;
+        return sz64 > SIZE_MAX - 8 ? UINT64_MAX : sz64 + 8;
+    }
+    return (uint64_t)sz + 8;
+}
+
+/* Chunk visitor for labl(), see riffchunk.h: */
+static inline int riffscan_labl_leaf(void *arg, const riffchunk_t *c) {
+    char *lab = arg;
+
+    if (memcmp(c->fcc, "labl", 4))
+        return RIFFCHUNK_NEXT;
+    /* The label we want? 200 is a magic number, 6 isn't (ID + 1 + '\0').
+     * We want it null terminated and start with a printable character! */
+    if (c->len <= RIFFSCAN_LABEL_MAX && c->len >= 6
+            && isprint(c->data[4]) && c->data[c->len - 1] == '\0') {
+        strcpy(lab, (const char *)(c->data + 4)); /* skip cue point ID */
+        return 2;
+    }
+    return RIFFCHUNK_NEXT;
+}
+
+/*
+ * Find the first labl chunk of the stream p, len bytes long, holding a
+ * null-terminated label string with length > 0, and copy its text to
+ * lab, which must have room for RIFFSCAN_LABEL_MAX + 1 characters.
+ * The label is sanitized for use in file names.  Returns lab, which
+ * holds an empty string if no label was found.
+ */
+static inline char *labl(const void *p, size_t len, int endianess, char *lab) {
+    riffchunk_visitor_t v = { NULL, NULL, riffscan_labl_leaf, lab };
+
+    (void)endianess;
+    *lab = '\0';
+    riffchunk_walk(p, len, &v);
+    /* Sanitize label */
+    for (char *c = lab; *c; ++c) {
+        if (!isprint((unsigned char)*c) || strchr("/\\ ", *c))
+            *c = '_';
+    }
+    return lab;
+}
+
+/*
+ * Prepare scanning buffer base of length size with default settings.
+ */
+static inline void riffscan_init(riffscan_t *s, const void *base, size_t size) {
+    memset(s, 0, sizeof *s);
+    s->base = base;
+    s->size = size;
+}
+
+/*
+ * Return a pointer to the first non-zero byte in [p, end), or end.
+ */
+static inline const uint8_t *zero_run(const uint8_t *p, const uint8_t *end) {
+    /* Scalar up to the next 64 byte boundary: */
+    while (p < end && ((uintptr_t)p & 63)) {
+        if (*p)
+            return p;
+        ++p;
+    }
+    /* Test whole blocks of 64 bytes: */
+    while (end - p >= 64) {
+#ifdef __SSE2__
+        const __m128i *v = (const __m128i *)p;
+        __m128i x = _mm_or_si128(_mm_or_si128(_mm_load_si128(v), _mm_load_si128(v + 1)),
+                                 _mm_or_si128(_mm_load_si128(v + 2), _mm_load_si128(v + 3)));
+        if (0xffff != _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())))
+            break;
+#else
+        uint64_t w[8], x = 0;
+        memcpy(w, p, sizeof w);
+        for (int i = 0; i < 8; ++i)
+            x |= w[i];
+        if (x)
+            break;
+#endif
+        p += 64;
+    }
+    while (p < end && !*p)
+        ++p;
+    return p;
+}
+
+/*
+ * Skip zero bytes and holes starting at p.  Returns a pointer to the
+ * first byte in [p, end) that may be non-zero, or end.
+ */
+static inline const uint8_t *riffscan_skip_zero(const riffscan_t *s,
+                                        const uint8_t *p, const uint8_t *end) {
+    const uint8_t *lim;
+    size_t off, lo, hi, mid;
+
+    while (p < end) {
+        /* Locate the first hole ending after p: */
+        off = p - s->base;
+        for (lo = 0, hi = s->nholes; lo < hi; ) {
+            mid = lo + (hi - lo) / 2;
+            if (s->holes[mid].end <= off)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < s->nholes && s->holes[lo].start <= off) {
+            p = s->base + s->holes[lo].end;
+            continue;
+        }
+        lim = lo < s->nholes ? s->base + s->holes[lo].start : end;
+        if (lim > end)
+            lim = end;
+        p = zero_run(p, lim);
+        if (p < lim || lim == end)
+            break;
+    }
+    return p < end ? p : end;
+}
+
+/*
+ * Boyer-Moore-Horspool search for any of the 4 byte signatures sigs in
+ * [p, end), skipping runs of zero bytes and holes.
+ * This only works because a signature never contains a zero byte:  Any
+ * window overlapping a zero byte cannot match.  For a set of signatures
+ * each byte skips as far as the signature it allows the least for.
+ */
+static inline const uint8_t *riffscan_search(const riffscan_t *s,
+                                 const uint8_t *p, const uint8_t *end,
+                                 const char *const *sigs) {
+    const uint8_t *k, *q, *cend;
+    size_t skip[256];
+    uint8_t last[256];
+    int i, j;
+
+    if (end - p < 4)
+        return NULL;
+    for (i = 0; i < 256; ++i)
+        skip[i] = 4;
+    memset(last, 0, sizeof last);
+    for (j = 0; sigs[j]; ++j) {
+        const uint8_t *ndl = (const uint8_t *)sigs[j];
+        for (i = 0; i < 3; ++i)
+            if (skip[ndl[i]] > (size_t)(3 - i))
+                skip[ndl[i]] = 3 - i;
+        last[ndl[3]] = 1;
+    }
+
+    for (k = p + 3; k < end; ) {
+        /* Report progress in chunks, before touching the data: */
+        cend = end;
+        if (s->progress) {
+            if ((size_t)(end - k) > RIFFSCAN_CHUNK)
+                cend = k + RIFFSCAN_CHUNK;
+            s->progress(s->progress_arg, cend - k);
+        }
+        while (k < cend) {
+            if (*k == 0) {
+                q = riffscan_skip_zero(s, k, end);
+                if (end - q < 4)
+                    return NULL;
+                /* Skipped bytes are not examined, extend the chunk: */
+                cend = (size_t)(end - cend) > (size_t)(q - k) ? cend + (q - k) : end;
+                k = q + 3;
+                continue;
+            }
+            if (last[*k] && riffscan_is_sig(k - 3, sigs))
+                return k - 3;
+            k += skip[*k];
+        }
+    }
+    return NULL;
+}
+
+/* Alignment in effect, 1 while still inferring it: */
+static inline size_t riffscan_stride(const riffscan_t *s) {
+    return s->align == RIFFSCAN_ALIGN_AUTO || s->align < 1 ? 1 : s->align;
+}
+
+/*
+ * Locate one of the stream signatures sigs at or after p, starting
+ * before end.
+ * With an alignment in effect only aligned offsets are tested.  If the
+ * stream chain is broken, i.e. there is no signature at the first
+ * aligned offset after the end of the previous stream, the range from
+ * the end of that stream on is fully scanned instead, up to the next
+ * stream, aligned or not.  Searching for the aligned hit first and
+ * scanning the gap up to it would rescan the same range for each of a
+ * run of unaligned streams.
+ */
+static inline const uint8_t *riffscan_find(const riffscan_t *s,
+                   const uint8_t *p, const uint8_t *end, const char *const *sigs) {
+    size_t a = riffscan_stride(s);
+    size_t pos = p - s->base, acc = pos, z;
+    const uint8_t *hit = NULL, *lim = end, *bend = s->base + s->size;
+
+    if (p >= end)
+        return NULL;
+    if (a == 1)
+        return riffscan_search(s, p, bend - end > 3 ? end + 3 : bend, sigs);
+    if (s->chain && s->chain < end) {
+        z = (s->chain - s->base + a - 1) / a * a;
+        if (s->base + z >= end || z + 4 > s->size
+            || !riffscan_is_sig(s->base + z, sigs))
+            lim = s->chain > p ? s->chain : p;
+    }
+    for (pos = (pos + a - 1) / a * a;
+            s->base + pos < lim && pos + 4 <= s->size; pos += a) {
+        if (s->progress && pos - acc >= RIFFSCAN_CHUNK) {
+            s->progress(s->progress_arg, pos - acc);
+            acc = pos;
+        }
+        if (s->base[pos] == 0) {
+            /* Continue at the first aligned offset after the zero run,
+             * which does not count as scanned: */
+            z = riffscan_skip_zero(s, s->base + pos, bend) - s->base;
+            acc += z - pos;
+            pos = (z + a - 1) / a * a - a;
+        }
+        else if (riffscan_is_sig(s->base + pos, sigs)) {
+            hit = s->base + pos;
+            break;
+        }
+    }
+    if (s->progress && pos > acc)
+        s->progress(s->progress_arg, pos - acc);
+    if (!hit && lim < end)
+        hit = riffscan_search(s, lim, bend - end > 3 ? end + 3 : bend, sigs);
+    return hit;
+}
+
+/* Pick the alignment once enough stream offsets have been collected. */
+static inline void riffscan_infer_align(riffscan_t *s, size_t offs) {
+    size_t a;
+
+    s->auto_bits |= offs;
+    if (++s->auto_cnt < RIFFSCAN_AUTO_HITS)
+        return;
+    a = s->auto_bits & -s->auto_bits;   /* lowest set bit */
+    if (a == 0 || a > RIFFSCAN_AUTO_MAX)
+        a = RIFFSCAN_AUTO_MAX;
+    s->align = a < RIFFSCAN_AUTO_MIN ? 1 : a;
+}
+
+/*
+ * Report the next stream in e.
+ * Returns 1 if a stream was found, 0 at the end of the buffer.
+ */
+static inline int riffscan_next(riffscan_t *s, riffscan_entry_t *e) {
+    const uint8_t *riff, *next, *end = s->base + s->size;
+    const uint8_t *lim;
+    size_t remsize;
+    uint64_t len;
+
+    lim = s->limit && s->limit < s->size ? s->base + s->limit : end;
+    if (!s->started) {
+        /* Where there's no RIFF, there might be a RIFX ... */
+        s->started = 1;
+        s->chain = s->base + (s->start < s->size ? s->start : s->size);
+        for (s->endianess = 0; s->endianess < 2; ++s->endianess)
+            if (NULL != (s->cur = riffscan_find(s, s->chain, lim, riffscan_sigs[s->endianess])))
+                break;
+        if (!s->cur)    /* ... or nothing at all. */
+            s->endianess = 0;
+    }
+    riff = s->cur;
+    if (!riff || riff >= lim) {
+        s->cur = NULL;
+        return 0;
+    }
+    remsize = s->size - (riff - s->base);
+    if (remsize <= 8) {
+        s->cur = NULL;
+        return 0;
+    }
+    e->offs = riff - s->base;
+    e->endianess = s->endianess;
+    if (s->align == RIFFSCAN_ALIGN_AUTO)
+        riffscan_infer_align(s, e->offs);
+    /* Read length info or guess stream length.  Even when guessing, the
+     * size field tells where the chain of aligned streams should go on: */
+    len = riffscan_len(riff, remsize, s->endianess);
+    s->chain = riff + (len > remsize ? remsize : (size_t)len);
+    if (s->guess_length) {
+        next = riffscan_find(s, riff + 4, end, riffscan_sigs[s->endianess]);
+        e->len = next ? (size_t)(next - riff) : remsize;
+    }
+    else {
+        e->len = s->chain - riff;
+        next = riffscan_find(s, s->skip_inner ? s->chain : riff + 4,
+                             lim, riffscan_sigs[s->endianess]);
+    }
+    s->cur = next;
+    return 1;
+}
+
+#endif /* RIFFSCAN_H_INCLUDED */
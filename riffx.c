@@ -35,21 +35,46 @@
  *
  */
 
+#define _GNU_SOURCE
 
 #include <ctype.h>
 #include <errno.h>
 #include <limits.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <dirent.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysinfo.h>
+#include <sys/sysmacros.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "riffidx.h"
+#include "riffscan.h"
+#include "wave.h"
+#include "wwise.h"
 
 
 #define LOG(...)    fprintf(stderr, __VA_ARGS__)
@@ -79,8 +104,11 @@ static inline int mkdirp(const char *pathname, mode_t mode) {
         p = strchr(p, '/');
         if (p)
             *p = '\0';
-        if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode))
+        if (stat(path, &sb) != 0 || !S_ISDIR(sb.st_mode)) {
             err = mkdir(path, mode);
+            if (err && errno == EEXIST)     /* someone else was faster */
+                err = 0;
+        }
         if (p)
             *p++ = '/';
     } while (!err && p && *p);
@@ -88,43 +116,117 @@ static inline int mkdirp(const char *pathname, mode_t mode) {
     return err;
 }
 
+/*
+ * Handles of the output directories written to, shared by all jobs and
+ * threads, so that files are created relative to their directory rather
+ * than resolving its whole path again for each of them.  Once there are
+ * DIR_HANDLES_MAX, handles not in use are recycled.
+ */
+#define DIR_HANDLES_MAX 64
+
+static struct {
+    pthread_mutex_t mtx;
+    char *path[DIR_HANDLES_MAX];    /* "" for a stale handle */
+    int fd[DIR_HANDLES_MAX];
+    unsigned refs[DIR_HANDLES_MAX];
+    unsigned n;
+} dirs = { PTHREAD_MUTEX_INITIALIZER, { NULL }, { 0 }, { 0 }, 0 };
 
-/* mem_mem
- * Locate needle of length nlen in haystack of length hlen.
- * Returns a pointer to the first occurrence of needle in haystack, or
- * haystack for a needle of zero length, or NULL if needle was not found
- * in haystack.
- *
- * Uses the Boyer-Moore-Horspool search algorithm, see
- * https://en.wikipedia.org/wiki/Boyer–Moore–Horspool_algorithm
- *
- * For our tiny needles and non-pathologic haystacks this borders on
- * overkill, but meh.
+/*
+ * Get a handle of directory path, which is created if missing.  Returns
+ * the handle, or -1, and in *slot what to pass to dir_put().
  */
-static inline void *mem_mem(const void *haystack, size_t hlen,
-                     const void *needle, size_t nlen) {
-    size_t k, skip[256];
-    const uint8_t *hst = (const uint8_t *)haystack;
-    const uint8_t *ndl = (const uint8_t *)needle;
+static int dir_get(const char *path, int *slot) {
+    unsigned i, reuse = DIR_HANDLES_MAX;
+    int fd;
+    char *p;
+
+    *slot = -1;
+    pthread_mutex_lock(&dirs.mtx);
+    for (i = 0; i < dirs.n; ++i) {
+        if (0 == strcmp(dirs.path[i], path)) {
+            ++dirs.refs[i];
+            *slot = i;
+            fd = dirs.fd[i];
+            goto out;
+        }
+        if (!dirs.refs[i])
+            reuse = i;
+    }
+    fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT && 0 == mkdirp(path, 0755))
+        fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || !(p = strdup(path)))
+        goto out;
+    if (dirs.n < DIR_HANDLES_MAX)
+        i = dirs.n++;
+    else if ((i = reuse) < DIR_HANDLES_MAX) {
+        close(dirs.fd[i]);
+        free(dirs.path[i]);
+    }
+    else {
+        /* All in use, the caller gets a handle of its own: */
+        free(p);
+        goto out;
+    }
+    dirs.path[i] = p;
+    dirs.fd[i] = fd;
+    dirs.refs[i] = 1;
+    *slot = i;
+out:
+    pthread_mutex_unlock(&dirs.mtx);
+    return fd;
+}
 
-    if (nlen == 0)
-        return (void *)haystack;
+/* Release handle fd from dir_get(), stale if its directory is gone: */
+static void dir_put(int fd, int slot, int stale) {
+    if (slot < 0) {
+        close(fd);
+        return;
+    }
+    pthread_mutex_lock(&dirs.mtx);
+    --dirs.refs[slot];
+    if (stale)
+        dirs.path[slot][0] = '\0';
+    pthread_mutex_unlock(&dirs.mtx);
+}
 
-    /* Set up the finite state machine we use. */
-    for (k = 0; k < 256; ++k)
-        skip[k] = nlen;
-    for (k = 0; k < nlen - 1; ++k)
-        skip[ndl[k]] = nlen - k - 1;
+/*
+ * Create file path for writing, along with any missing parent
+ * directories, so output directories only come into existence once
+ * there is something to put into them.
+ */
+static int create_file(const char *path) {
+    int fd, dfd, slot, err;
+    const char *base = strrchr(path, '/');
+    char *s;
 
-    /* Do the search. */
-    for (k = nlen - 1; k < hlen; k += skip[hst[k]]) {
-        int i, j;
-        for (j = nlen - 1, i = k; j >= 0 && hst[i] == ndl[j]; j--)
-            i--;
-        if (j == -1)
-            return (void *)(hst + i + 1);
+    if (base && base != path) {
+        char dir[base - path + 1];
+        memcpy(dir, path, base - path);
+        dir[base - path] = '\0';
+        if (0 <= (dfd = dir_get(dir, &slot))) {
+            fd = openat(dfd, base + 1, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            err = errno;
+            dir_put(dfd, slot, fd < 0 && err == ENOENT);
+            if (fd >= 0 || err != ENOENT) {
+                errno = err;
+                return fd;
+            }
+        }
     }
-    return NULL;
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 && errno == ENOENT) {
+        char dir[strlen(path) + 1];
+        strcpy(dir, path);
+        s = strrchr(dir, '/');
+        if (s && s != dir) {
+            *s = '\0';
+            if (0 == mkdirp(dir, 0755))
+                fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+    }
+    return fd;
 }
 
 
@@ -140,36 +242,489 @@ static inline void *mem_mem(const void *haystack, size_t hlen,
  * guess_length:
  * 0: read the stream length from the RIFF header size field
  * 1: assume the stream ends at the beginning of the next (or EOF)
+ *
+ * stdout_frames:
+ * 0: dump each stream into a file of its own
+ * 1: write framed streams to stdout, do not create any files
+ *
+ * align:
+ * 0: test for a stream at every byte offset
+ * N: test only at multiples of N, see riffscan.h
+ *
+ * names_file:
+ * NULL: no media names
+ * path: Wwise SoundbanksInfo file to name streams by their media IDs
+ *
+ * range_start, range_end:
+ * only dump streams starting in [range_start, range_end), 0 meaning EOF
+ *
+ * name_by_offset:
+ * 0: number output files by stream index
+ * 1: number output files by stream offset (hexadecimal)
+ *
+ * shard_k, shard_n:
+ * only process the inputs assigned to shard k of n, 0 <= k < n
+ *
+ * shard_by_size:
+ * 0: assign inputs to shards by the hash of their path
+ * 1: balance the total input size of all shards
+ *
+ * manifest:
+ * NULL: no manifest
+ * path: file to record input, offset, length and output of each stream
+ *
+ * max_read_rate, max_write_rate, max_files_rate:
+ * 0: unlimited
+ * N: limit input scanned and output written to N bytes per second, and
+ *    the creation of output files to N files per second
+ *
+ * idle:
+ * 0: run with normal CPU and I/O priority
+ * 1: run with SCHED_IDLE CPU and idle class I/O priority
+ *
+ * recurse:
+ * 0: report streams nested in other streams like any other stream
+ * N: carve nested streams from their containers, up to N levels deep
+ *
+ * threads:
+ * 0: process input files one after the other
+ * N: process input files on a pool of N worker threads
+ *
+ * watch_dir:
+ * NULL: process the input files given on the command line
+ * path: process files as they are completed in this spool directory
+ *
+ * job_file:
+ * NULL: process the input files given on the command line
+ * path: process the jobs listed in this file
+ *
+ * odir:
+ * path: output directory
+ *
+ * metrics_file, metrics_socket, metrics_interval:
+ * NULL: no metrics
+ * path: publish metrics in the Prometheus text format to this file,
+ *       rewritten every metrics_interval seconds, or to every client
+ *       connecting to this Unix socket
+ *
+ * entries_file:
+ * NULL: scan the input files for streams
+ * path: only extract the entries listed in this file, without scanning
+ *
+ * follow, follow_timeout:
+ * 0: process each input file as it is
+ * 1: process input files as they grow, until closed by the writer or
+ *    they did not grow for follow_timeout seconds
+ *
+ * normalize:
+ * 0: dump streams as they are
+ * 1: dump little endian PCM streams with a canonical WAVE header, see
+ *    wave.h, and the suffix wav
+ *
+ * decode:
+ * 0: dump IMA ADPCM streams as they are
+ * 1: decode IMA ADPCM streams to 16 bit PCM WAVE files, suffix wav
+ *
+ * silent, silence_level:
+ * SILENT_OFF: dump all streams
+ * SILENT_SKIP: do not dump PCM and IMA ADPCM streams whose samples all
+ *    stay below silence_level (fraction of full scale), see wave.h
+ * SILENT_COUNT: dump them, but count them in the metrics
+ *
+ * write_method:
+ * WRITE_COPY: copy stream data in the kernel where possible, see copy_out()
+ * WRITE_PLAIN: always write stream data from the input mapping
+ *
+ * calibrate, profile:
+ * 0: load the tuning profile, see calibrate(), if there is one
+ * 1: measure the best tuning for this host, save it to the profile, exit
+ * NULL: profile at $XDG_CONFIG_HOME/riffx/profile or ~/.config/...
+ * "": no profile
+ * path: profile file
+ *
+ * stripe, nstripe, stripe_by, stripe_writers:
+ * 0: write all streams below odir
+ * N: spread the streams over odir and the N more output roots in
+ *    stripe, which mirror the layout below odir, picking the root by
+ *    STRIPE_RR (round robin) or STRIPE_SIZE (fewest bytes queued for
+ *    its device); each device is written by stripe_writers threads
+ *
+ * index_file:
+ * NULL: dump the streams found
+ * path: dump nothing, write an index of the streams found to this file
+ *       instead, see riffidx.h
+ *
+ * query_file:
+ * NULL: process the input files
+ * path: look up the arguments in this index, see query()
+ *
+ * The job file can override the options that affect how an input is
+ * processed, i.e. all but verbose, stdout_frames, shard_*, manifest,
+ * max_*_rate, idle, threads, watch_dir, follow*, entries_file,
+ * metrics_*, stripe*, index_file and query_file, per job.  Jobs with
+ * an output directory of their own are not striped.
  */
 
-static struct {
+static struct config {
     int use_basename;
     int use_label;
     int guess_length;
     int verbose;
-    int endianess; /* No cmd line option for this, we figure it out. */
+    int stdout_frames;
+    size_t align;
+    const char *names_file;
+    uint64_t range_start, range_end;
+    int name_by_offset;
+    unsigned shard_k, shard_n;
+    int shard_by_size;
+    const char *manifest;
+    uint64_t max_read_rate, max_write_rate;
+    double max_files_rate;
+    int idle;
+    unsigned recurse;
+    unsigned threads;
+    const char *watch_dir;
+    const char *job_file;
+    const char *odir;
+    int follow;
+    unsigned follow_timeout;
+    const char *entries_file;
+    const char *metrics_file;
+    const char *metrics_socket;
+    unsigned metrics_interval;
+    int silent;
+    double silence_level;
+    int normalize;
+    int decode;
+    const char **stripe;
+    unsigned nstripe;
+    int stripe_by;
+    unsigned stripe_writers;
+    int write_method;
+    int calibrate;
+    const char *profile;
+    const char *index_file;
+    const char *query_file;
 } cfg = {
     0,
     0,
     0,
     0,
     0,
+    0,
+    NULL,
+    0, 0,
+    0,
+    0, 0,
+    0,
+    NULL,
+    0, 0,
+    0.0,
+    0,
+    0,
+    0,
+    NULL,
+    NULL,
+    "output",
+    0,
+    30,
+    NULL,
+    NULL,
+    NULL,
+    10,
+    0,
+    0.001,
+    0,
+    0,
+    NULL,
+    0,
+    0,
+    2,
+    0,
+    0,
+    NULL,
+    NULL,
+    NULL,
+};
+
+/* Tuning options given on the command line, which the profile must
+ * not override: */
+enum { GIVEN_THREADS = 1, GIVEN_STRIPE_WRITERS = 2, GIVEN_WRITE_METHOD = 4 };
+static unsigned cfg_given;
+
+enum { SILENT_OFF, SILENT_SKIP, SILENT_COUNT };
+enum { STRIPE_SIZE, STRIPE_RR };
+enum { WRITE_COPY, WRITE_PLAIN };
+
+/* Manifest stream opened from cfg.manifest: */
+static FILE *manifest_fp;
+
+/* Long-only options, values out of char range: */
+enum {
+    OPT_STDOUT_FRAMES = 0x100,
+    OPT_ALIGN,
+    OPT_NAMES,
+    OPT_RANGE,
+    OPT_SHARD,
+    OPT_SHARD_BY_SIZE,
+    OPT_MANIFEST,
+    OPT_MAX_READ_RATE,
+    OPT_MAX_WRITE_RATE,
+    OPT_MAX_FILES_PER_SEC,
+    OPT_IDLE,
+    OPT_RECURSE,
+    OPT_WATCH,
+    OPT_JOBS,
+    OPT_FOLLOW,
+    OPT_FOLLOW_TIMEOUT,
+    OPT_ENTRIES,
+    OPT_METRICS_FILE,
+    OPT_METRICS_SOCKET,
+    OPT_METRICS_INTERVAL,
+    OPT_SILENT,
+    OPT_SILENCE_LEVEL,
+    OPT_NORMALIZE,
+    OPT_DECODE,
+    OPT_STRIPE,
+    OPT_STRIPE_BY,
+    OPT_STRIPE_WRITERS,
+    OPT_WRITE_METHOD,
+    OPT_CALIBRATE,
+    OPT_PROFILE,
+    OPT_NO_PROFILE,
+    OPT_INDEX,
+    OPT_QUERY,
+};
+
+static const struct option long_opts[] = {
+    { "stdout-frames", no_argument, NULL, OPT_STDOUT_FRAMES },
+    { "align", required_argument, NULL, OPT_ALIGN },
+    { "names", required_argument, NULL, OPT_NAMES },
+    { "range", required_argument, NULL, OPT_RANGE },
+    { "shard", required_argument, NULL, OPT_SHARD },
+    { "shard-by-size", no_argument, NULL, OPT_SHARD_BY_SIZE },
+    { "manifest", required_argument, NULL, OPT_MANIFEST },
+    { "max-read-rate", required_argument, NULL, OPT_MAX_READ_RATE },
+    { "max-write-rate", required_argument, NULL, OPT_MAX_WRITE_RATE },
+    { "max-files-per-sec", required_argument, NULL, OPT_MAX_FILES_PER_SEC },
+    { "idle", no_argument, NULL, OPT_IDLE },
+    { "recurse", required_argument, NULL, OPT_RECURSE },
+    { "threads", required_argument, NULL, 'j' },
+    { "watch", required_argument, NULL, OPT_WATCH },
+    { "jobs", required_argument, NULL, OPT_JOBS },
+    { "follow", no_argument, NULL, OPT_FOLLOW },
+    { "follow-timeout", required_argument, NULL, OPT_FOLLOW_TIMEOUT },
+    { "entries", required_argument, NULL, OPT_ENTRIES },
+    { "metrics-file", required_argument, NULL, OPT_METRICS_FILE },
+    { "metrics-socket", required_argument, NULL, OPT_METRICS_SOCKET },
+    { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+    { "silent", required_argument, NULL, OPT_SILENT },
+    { "silence-level", required_argument, NULL, OPT_SILENCE_LEVEL },
+    { "normalize", no_argument, NULL, OPT_NORMALIZE },
+    { "decode", no_argument, NULL, OPT_DECODE },
+    { "stripe", required_argument, NULL, OPT_STRIPE },
+    { "stripe-by", required_argument, NULL, OPT_STRIPE_BY },
+    { "stripe-writers", required_argument, NULL, OPT_STRIPE_WRITERS },
+    { "write-method", required_argument, NULL, OPT_WRITE_METHOD },
+    { "calibrate", no_argument, NULL, OPT_CALIBRATE },
+    { "profile", required_argument, NULL, OPT_PROFILE },
+    { "no-profile", no_argument, NULL, OPT_NO_PROFILE },
+    { "index", required_argument, NULL, OPT_INDEX },
+    { "query", required_argument, NULL, OPT_QUERY },
+    { NULL, 0, NULL, 0 }
 };
 
 static inline void usage(const char *argv0) {
-    LOG("Usage: %s [-b] [-g] [-l] [-v] infile ... [outdir]\n"
+    LOG("Usage: %s [-b] [-g] [-l] [-v] [-j N] [options] infile ... [outdir]\n"
+        "       %s --watch DIR [options] [outdir]\n"
+        "       %s --jobs FILE [options]\n"
+        "       %s --query INDEX hash:HEX|label:TEXT|file ...\n"
         "  -b : create flat output directory\n"
         "  -g : ignore size fields, guess stream length (imprecise!)\n"
         "  -l : use extracted labels in filenames (unreliable!)\n"
         "  -v : be more verbose\n"
-        , argv0);
+        "  -j N, --threads N : process input files on N worker threads\n"
+        "  --stdout-frames : write framed streams to stdout, no files\n"
+        "  --align N|auto  : look for streams at multiples of N bytes only\n"
+        "  --names FILE    : name streams by media ID from SoundbanksInfo\n"
+        "  --range [S]:[E] : only dump streams starting at offset S up to E\n"
+        "  --shard K/N     : only process the inputs of shard K (0..N-1)\n"
+        "  --shard-by-size : balance shards by input size, not path hash\n"
+        "  --manifest FILE : record input, offset, length and output file\n"
+        "  --max-read-rate N     : scan at most N bytes/s (K/M/G suffix)\n"
+        "  --max-write-rate N    : write at most N bytes/s (K/M/G suffix)\n"
+        "  --max-files-per-sec N : create at most N output files/s\n"
+        "  --idle          : run with idle CPU and I/O priority\n"
+        "  --recurse N     : carve nested streams, up to N levels deep\n"
+        "  --watch DIR     : process files completed in DIR until killed\n"
+        "  --jobs FILE     : run the jobs listed in FILE\n"
+        "  --follow        : process input files while they are written\n"
+        "  --follow-timeout SECS : stop following after SECS idle (30)\n"
+        "  --entries FILE  : only extract the entries listed in FILE\n"
+        "  --metrics-file FILE   : write Prometheus metrics to FILE\n"
+        "  --metrics-socket PATH : serve Prometheus metrics on Unix socket PATH\n"
+        "  --metrics-interval SECS : metrics file update interval (10)\n"
+        "  --silent skip|count : skip or count silent PCM/ADPCM streams\n"
+        "  --silence-level DB  : silence threshold in dBFS (-60)\n"
+        "  --normalize     : write PCM streams with a plain WAVE header\n"
+        "  --decode        : decode IMA ADPCM streams to PCM WAVE files\n"
+        "  --stripe DIR    : spread streams over outdir and DIR (repeatable)\n"
+        "  --stripe-by size|rr : balance roots by queued bytes or round robin\n"
+        "  --stripe-writers N  : writer threads per output device (2)\n"
+        "  --write-method copy|write : copy streams in the kernel, or write them\n"
+        "  --calibrate     : measure the best tuning for inputs and outdir\n"
+        "  --profile FILE  : tuning profile to load or calibrate\n"
+        "  --no-profile    : do not load a tuning profile\n"
+        "  --index FILE    : write an index of the streams found, dump nothing\n"
+        "  --query FILE    : find streams by content hash or label in index FILE\n"
+        , argv0, argv0, argv0, argv0);
     exit(EXIT_FAILURE);
 }
 
+/*
+ * Parse a byte count with an optional binary unit suffix (K, M, G, T).
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_size(const char *s, uint64_t *val) {
+    const char *units = "KMGT";
+    const char *u;
+    char *end;
+    uint64_t v;
+
+    if (!isdigit((unsigned char)*s))
+        return -1;
+    errno = 0;
+    v = strtoull(s, &end, 0);
+    if (errno)
+        return -1;
+    if (*end && NULL != (u = strchr(units, toupper((unsigned char)*end)))) {
+        for (int shift = 10 * (u - units + 1); shift > 0; shift -= 10) {
+            if (v > UINT64_MAX >> 10)
+                return -1;
+            v <<= 10;
+        }
+        ++end;
+    }
+    if (*end)
+        return -1;
+    *val = v;
+    return 0;
+}
+
+/* Parse a write method, "copy" or "write": */
+static int parse_write_method(const char *s, int *val) {
+    if (0 == strcmp(s, "copy"))
+        *val = WRITE_COPY;
+    else if (0 == strcmp(s, "write"))
+        *val = WRITE_PLAIN;
+    else
+        return -1;
+    return 0;
+}
+
+/* Strip leading and trailing white space from s in place: */
+static char *trim(char *s) {
+    char *e;
+
+    while (isspace((unsigned char)*s))
+        ++s;
+    e = s + strlen(s);
+    while (e > s && isspace((unsigned char)e[-1]))
+        --e;
+    *e = '\0';
+    return s;
+}
+
+/*
+ * Parse an alignment: "auto" or a number from 1 to 2^30.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_align(const char *s, size_t *align) {
+    char *end;
+    unsigned long v;
+
+    if (0 == strcmp(s, "auto")) {
+        *align = RIFFSCAN_ALIGN_AUTO;
+        return 0;
+    }
+    errno = 0;
+    v = strtoul(s, &end, 0);
+    if (errno || *end || v < 1 || v > 1 << 30)
+        return -1;
+    *align = v;
+    return 0;
+}
+
+/*
+ * Parse a byte range "START:END" into c, either bound may be omitted.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_range(const char *s, struct config *c) {
+    const char *colon = strchr(s, ':');
+    char start[colon ? colon - s + 1 : 1];
+
+    if (!colon)
+        return -1;
+    memcpy(start, s, colon - s);
+    start[colon - s] = '\0';
+    ++colon;
+    c->range_start = c->range_end = 0;
+    if ((*start && 0 != parse_size(start, &c->range_start))
+            || (*colon && 0 != parse_size(colon, &c->range_end))
+            || (c->range_end && c->range_end <= c->range_start))
+        return -1;
+    c->name_by_offset = 1;
+    return 0;
+}
+
+/*
+ * Parse a decimal number no larger than max.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_count(const char *s, unsigned long max, unsigned *val) {
+    char *end;
+    unsigned long n;
+
+    if (!isdigit((unsigned char)*s))
+        return -1;
+    n = strtoul(s, &end, 10);
+    if (*end || n > max)
+        return -1;
+    *val = n;
+    return 0;
+}
+
+/* Parse what to do with silent streams, see struct config: */
+static int parse_silent(const char *s, int *val) {
+    if (0 == strcmp(s, "skip"))
+        *val = SILENT_SKIP;
+    else if (0 == strcmp(s, "count"))
+        *val = SILENT_COUNT;
+    else if (0 == strcmp(s, "off"))
+        *val = SILENT_OFF;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Parse a level below full scale in dBFS, e.g. "-60", into a fraction
+ * of full scale.  Returns 0 on success, -1 on error.
+ */
+static int parse_level(const char *s, double *val) {
+    char *end;
+    double db = strtod(s, &end);
+
+    if (end == s || *end || !(db < 0) || db < -200)
+        return -1;
+    *val = pow(10, db / 20);
+    return 0;
+}
+
 static inline int config(int argc, char *argv[]) {
     int opt;
 
-    while ((opt = getopt(argc, argv, "+:bglv")) != -1) {
+    while ((opt = getopt_long(argc, argv, "+:bglvj:", long_opts, NULL)) != -1) {
         switch (opt) {
         case 'b':
            cfg.use_basename = 1;
@@ -183,6 +738,169 @@ static inline int config(int argc, char *argv[]) {
         case 'v':
            cfg.verbose = 1;
            break;
+        case OPT_STDOUT_FRAMES:
+           cfg.stdout_frames = 1;
+           break;
+        case OPT_ALIGN:
+           if (0 != parse_align(optarg, &cfg.align)) {
+               LOG("Invalid alignment '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_NAMES:
+           cfg.names_file = optarg;
+           break;
+        case OPT_RANGE:
+           if (0 != parse_range(optarg, &cfg)) {
+               LOG("Invalid range '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_SHARD:
+           if (2 != sscanf(optarg, "%u/%u", &cfg.shard_k, &cfg.shard_n)
+                   || cfg.shard_n < 1 || cfg.shard_k >= cfg.shard_n) {
+               LOG("Invalid shard '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_SHARD_BY_SIZE:
+           cfg.shard_by_size = 1;
+           break;
+        case OPT_MANIFEST:
+           cfg.manifest = optarg;
+           break;
+        case OPT_MAX_READ_RATE:
+        case OPT_MAX_WRITE_RATE:
+           if (0 != parse_size(optarg, opt == OPT_MAX_READ_RATE
+                                ? &cfg.max_read_rate : &cfg.max_write_rate)) {
+               LOG("Invalid rate '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_MAX_FILES_PER_SEC: {
+           char *end;
+           cfg.max_files_rate = strtod(optarg, &end);
+           if (*end || !(cfg.max_files_rate >= 0)) {
+               LOG("Invalid rate '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        }
+        case OPT_IDLE:
+           cfg.idle = 1;
+           break;
+        case 'j':
+           if (0 != parse_count(optarg, 1024, &cfg.threads)) {
+               LOG("Invalid number of threads '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           cfg_given |= GIVEN_THREADS;
+           break;
+        case OPT_WATCH:
+           cfg.watch_dir = optarg;
+           break;
+        case OPT_JOBS:
+           cfg.job_file = optarg;
+           break;
+        case OPT_FOLLOW:
+           cfg.follow = 1;
+           break;
+        case OPT_ENTRIES:
+           cfg.entries_file = optarg;
+           break;
+        case OPT_METRICS_FILE:
+           cfg.metrics_file = optarg;
+           break;
+        case OPT_METRICS_SOCKET:
+           cfg.metrics_socket = optarg;
+           break;
+        case OPT_METRICS_INTERVAL:
+           if (0 != parse_count(optarg, 86400, &cfg.metrics_interval)
+                   || !cfg.metrics_interval) {
+               LOG("Invalid interval '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_SILENT:
+           if (0 != parse_silent(optarg, &cfg.silent)) {
+               LOG("Invalid silent stream action '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_NORMALIZE:
+           cfg.normalize = 1;
+           break;
+        case OPT_DECODE:
+           cfg.decode = 1;
+           break;
+        case OPT_STRIPE: {
+           const char **r = realloc(cfg.stripe, (cfg.nstripe + 1) * sizeof *r);
+           if (!r) {
+               LOG("Out of memory\n");
+               exit(EXIT_FAILURE);
+           }
+           cfg.stripe = r;
+           cfg.stripe[cfg.nstripe++] = optarg;
+           break;
+        }
+        case OPT_STRIPE_BY:
+           if (0 == strcmp(optarg, "size"))
+               cfg.stripe_by = STRIPE_SIZE;
+           else if (0 == strcmp(optarg, "rr"))
+               cfg.stripe_by = STRIPE_RR;
+           else {
+               LOG("Invalid stripe policy '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_STRIPE_WRITERS:
+           if (0 != parse_count(optarg, 64, &cfg.stripe_writers)
+                   || !cfg.stripe_writers) {
+               LOG("Invalid number of writers '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           cfg_given |= GIVEN_STRIPE_WRITERS;
+           break;
+        case OPT_WRITE_METHOD:
+           if (0 != parse_write_method(optarg, &cfg.write_method)) {
+               LOG("Invalid write method '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           cfg_given |= GIVEN_WRITE_METHOD;
+           break;
+        case OPT_CALIBRATE:
+           cfg.calibrate = 1;
+           break;
+        case OPT_PROFILE:
+           cfg.profile = optarg;
+           break;
+        case OPT_NO_PROFILE:
+           cfg.profile = "";
+           break;
+        case OPT_INDEX:
+           cfg.index_file = optarg;
+           break;
+        case OPT_QUERY:
+           cfg.query_file = optarg;
+           break;
+        case OPT_SILENCE_LEVEL:
+           if (0 != parse_level(optarg, &cfg.silence_level)) {
+               LOG("Invalid silence level '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_FOLLOW_TIMEOUT:
+           if (0 != parse_count(optarg, 86400, &cfg.follow_timeout)) {
+               LOG("Invalid timeout '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
+        case OPT_RECURSE:
+           if (0 != parse_count(optarg, 64, &cfg.recurse)) {
+               LOG("Invalid recursion depth '%s'\n", optarg);
+               usage(argv[0]);
+           }
+           break;
         default: /* '?' || ':' */
            usage(argv[0]);
            break;
@@ -191,197 +909,3490 @@ static inline int config(int argc, char *argv[]) {
     return optind;
 }
 
-static inline uint32_t get_ui32(const void *p) {
-    const uint8_t *b = p;
-    if (!cfg.endianess)     /* Little Endian byte order (RIFF) */
-        return b[0] | b[1] << 8 | b[2] << 16 | b[3] << 24;
-    /* Big Endian byte order (RIFX) */
-    return b[3] | b[2] << 8 | b[1] << 16 | b[0] << 24;
-}
-
 /*
- * Try to find a suitable "labl" chunk.
- * We should really parse the RIFF structure.  Instead, we are satisfied
- * with the first null-terminated label string with length > 0.
+ * Write len bytes from b to fd, retrying on short writes.
  */
-static inline const char *labl(const void *p, size_t len) {
-    static char lab[201] = "";
-    const uint8_t *b;
-    size_t l, ll;
+static inline int write_all(int fd, const void *b, size_t len) {
+    const uint8_t *p = b;
+    ssize_t n;
 
-    *lab = '\0';
-    b = p;
-    l = len;
-    while (l > 8 && NULL != (b = mem_mem(b, l, "labl", 4))) {
-        b += 4;    /* skip 'labl' */
-        l = len - (b - (uint8_t *)p);
-        ll = get_ui32(b);
-        if (ll > l - 4)
-            ll = l - 4;
-        /* The label we want? 200 is a magic number, 6 isn't (ID + 1 + '\0').
-         * We want it null terminated and start with a printable character! */
-        if (ll <= 200 && ll >= 6 && isprint(b[8]) && b[ll+4-1] == '\0') {
-            strcpy(lab, (const char *)(b + 8)); /* skip label size and ID */
-            break;
+    while (len > 0) {
+        n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
+        p += n;
+        len -= n;
     }
-    /* Sanitize label */
-    for (char *p = lab; *p; ++p) {
-        if (!isprint((unsigned char)*p) || strchr("/\\ ", *p))
-            *p = '_';
+    return 0;
+}
+
+/*
+ * Token bucket rate limiter.
+ * Taking tokens may overdraw the bucket, the caller is then put to
+ * sleep until the debt is paid off at the configured rate.  Bursts are
+ * limited to a quarter second worth of tokens.
+ */
+typedef struct {
+    double rate;        /* tokens per second, 0 for unlimited */
+    double tokens;
+    struct timespec last;
+    pthread_mutex_t mtx;
+} tbucket_t;
+
+static tbucket_t rd_bucket, wr_bucket, file_bucket;
+
+/* Chunk size for throttled I/O: */
+#define THROTTLE_CHUNK  (256 * 1024)
+
+static inline void tb_init(tbucket_t *tb, double rate) {
+    tb->rate = rate;
+    tb->tokens = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tb->last);
+    pthread_mutex_init(&tb->mtx, NULL);
+}
+
+static void tb_take(tbucket_t *tb, double n) {
+    struct timespec now, ts;
+    double dt, wait;
+
+    if (tb->rate <= 0)
+        return;
+    pthread_mutex_lock(&tb->mtx);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dt = (now.tv_sec - tb->last.tv_sec) + (now.tv_nsec - tb->last.tv_nsec) / 1e9;
+    tb->last = now;
+    tb->tokens += dt * tb->rate;
+    if (tb->tokens > tb->rate / 4)
+        tb->tokens = tb->rate / 4;
+    tb->tokens -= n;
+    wait = tb->tokens < 0 ? -tb->tokens / tb->rate : 0;
+    pthread_mutex_unlock(&tb->mtx);
+    /* Sleep off our debt without holding the lock: */
+    if (wait > 0) {
+        ts.tv_sec = (time_t)wait;
+        ts.tv_nsec = (long)((wait - ts.tv_sec) * 1e9);
+        while (0 != nanosleep(&ts, &ts) && errno == EINTR)
+            ;
     }
-    return lab;
 }
 
 /*
- * Dump RIFF stream.
- * Write a data blob of length len starting at b to a file whose name is
- * constructed from prefix, an optional label, a numeric id and a suffix.
+ * Counters for progress and metrics reports, updated by all workers.
+ * Relaxed atomics are all we need, as nobody depends on their order.
  */
-static inline int dump(const char *prefix, size_t id, const void *b, size_t len) {
-    int fd;
-    const char *suffix[] = {"riff", "rifx"};  /* dump filename suffix */
-    char of[strlen(prefix) + 255];
-    const char *lab;
+static struct {
+    atomic_uint_fast64_t bytes_scanned;
+    atomic_uint_fast64_t streams_found;
+    atomic_uint_fast64_t streams_written;
+    atomic_uint_fast64_t streams_silent;
+    atomic_uint_fast64_t bytes_written;
+    atomic_uint_fast64_t errors;
+    atomic_uint_fast64_t inputs_done;
+    atomic_uint_fast64_t inputs_queued;
+} stats;
 
-    /* Construct file name from prefix and label or id: */
-    lab = cfg.use_label ? labl(b, len) : "";
-    snprintf(of, sizeof of, "%s%s%s%06zu.%s",
-                    prefix, lab, *lab?"_":"", id, suffix[cfg.endianess]);
-    if (cfg.verbose)
-        LOG(": %8zu -> %s\n", len, of);
-    /* Caveat: This will overwrite any existing file with the same name! */
-    fd = creat(of, 0644);
-    if (0 > fd){
-        LOG("Failed to create %s: %s\n", of, strerror(errno));
-        return -1;
-    } else {
-        write(fd, b, len);
-        close(fd);
+static inline void stat_add(atomic_uint_fast64_t *c, uint64_t n) {
+    atomic_fetch_add_explicit(c, n, memory_order_relaxed);
+}
+
+static inline uint64_t stat_get(atomic_uint_fast64_t *c) {
+    return atomic_load_explicit(c, memory_order_relaxed);
+}
+
+/* Start of a log line, clears the progress line if there is one: */
+static const char *sol = "";
+
+/* Scanner progress hook, counts and throttles input: */
+static void scan_progress(void *arg, size_t n) {
+    (void)arg;
+    stat_add(&stats.bytes_scanned, n);
+    tb_take(&rd_bucket, n);
+}
+
+/*
+ * Write len bytes from b to fd, subject to the write rate limit.
+ */
+static inline int write_out(int fd, const void *b, size_t len) {
+    const uint8_t *p = b;
+    size_t n;
+
+    if (wr_bucket.rate <= 0)
+        return write_all(fd, p, len);
+    while (len > 0) {
+        n = len > THROTTLE_CHUNK ? THROTTLE_CHUNK : len;
+        tb_take(&wr_bucket, n);
+        if (0 != write_all(fd, p, n))
+            return -1;
+        p += n;
+        len -= n;
     }
     return 0;
 }
 
 /*
- * Traverse file fd and dump anything that looks like a RIFF stream.
+ * Lower our CPU and I/O scheduling priority to idle.
  */
-int extract(int fd, const char *pfx) {
-    const char *RIF_[] = {"RIFF", "RIFX"};
-    size_t id, rsize;
-    off_t fsize, remsize;
-    const uint8_t *riff, *mfile;
+static void set_idle(void) {
+    struct sched_param sp = { 0 };
+    /* IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0), IOPRIO_WHO_PROCESS */
+    const int ioprio = 3 << 13, who = 1;
 
-    fsize = lseek(fd, 0, SEEK_END);
-    lseek(fd, 0, SEEK_SET);
-    mfile = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
-    if (mfile == MAP_FAILED) {
-        LOG("mmap failed: %s\n", strerror(errno));
-        return -1;
+    if (0 != sched_setscheduler(0, SCHED_IDLE, &sp))
+        LOG("Failed to set SCHED_IDLE: %s\n", strerror(errno));
+#ifdef SYS_ioprio_set
+    if (0 != syscall(SYS_ioprio_set, who, 0, ioprio))
+        LOG("Failed to set idle I/O priority: %s\n", strerror(errno));
+#endif
+}
+
+/*
+ * Stream frame header, all fields in little endian byte order:
+ *
+ *   0  4  magic "RXF1"
+ *   4  4  header length, including the name
+ *   8  8  payload length
+ *  16  8  offset of the stream in its input file
+ *  24  1  byte order: 0 = RIFF (little endian), 1 = RIFX (big endian)
+ *  25  1  reserved, 0
+ *  26  2  name length
+ *  28  -  name, not null-terminated
+ *
+ * The payload immediately follows the header.
+ */
+#define FRAME_HDR_SIZE  28
+
+static inline void put_le(uint8_t *b, uint64_t v, int n) {
+    for (int i = 0; i < n; ++i, v >>= 8)
+        b[i] = v & 0xff;
+}
+
+/* Serializes output of different worker threads to stdout: */
+static pthread_mutex_t stdout_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Write a framed stream to stdout.
+ * When stdout is a pipe, the payload is spliced directly from the
+ * mapped input file, otherwise it falls back to plain write().
+ * The header is always written, as vmsplice() would merely reference
+ * the buffer instead of copying it.
+ */
+static inline int frame(const char *name, const void *b,
+                        const riffscan_entry_t *e) {
+    static int is_pipe = -1;
+    size_t nlen = strlen(name);
+    uint8_t hdr[FRAME_HDR_SIZE + nlen];
+    const uint8_t *p = (const uint8_t *)b + e->offs;
+    size_t len = e->len;
+
+    if (is_pipe < 0) {
+        struct stat st;
+        is_pipe = 0 == fstat(STDOUT_FILENO, &st) && S_ISFIFO(st.st_mode);
     }
-    id = 0;
-    /* Where there's no RIFF, there might be a RIFX ... */
-    for (cfg.endianess = 0; cfg.endianess < 2; ++cfg.endianess )
-        if (NULL != (riff = mem_mem(mfile, fsize, RIF_[cfg.endianess], 4)))
+    if (nlen > UINT16_MAX)
+        nlen = UINT16_MAX;
+    memcpy(hdr, "RXF1", 4);
+    put_le(hdr + 4, FRAME_HDR_SIZE + nlen, 4);
+    put_le(hdr + 8, len, 8);
+    put_le(hdr + 16, e->offs, 8);
+    put_le(hdr + 24, e->endianess, 1);
+    put_le(hdr + 25, 0, 1);
+    put_le(hdr + 26, nlen, 2);
+    memcpy(hdr + FRAME_HDR_SIZE, name, nlen);
+    /* Frames from different worker threads must not be interleaved: */
+    pthread_mutex_lock(&stdout_mtx);
+    if (0 != write_all(STDOUT_FILENO, hdr, FRAME_HDR_SIZE + nlen))
+        goto err;
+    while (is_pipe && len > 0) {
+        struct iovec iov = { (void *)p, len };
+        ssize_t n;
+        if (wr_bucket.rate > 0 && iov.iov_len > THROTTLE_CHUNK)
+            iov.iov_len = THROTTLE_CHUNK;
+        n = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EINVAL && errno != ENOSYS)
+                goto err;
+            is_pipe = 0;    /* Splicing not supported, write instead. */
             break;
-    if (!riff)  /* ... or nothing at all. */
-        return 0;
-    remsize = fsize - (riff - mfile);
-    while (remsize > 8 && NULL != riff) {
-        const uint8_t *next;
-        next = mem_mem(riff + 4, remsize - 4, RIF_[cfg.endianess], 4);
-        /* Read length info or guess stream length: */
-        if (cfg.guess_length) {
-            rsize = next ? next - riff : remsize;
         }
-        else {
-            rsize = get_ui32(riff + 4) + 8; /* size + 'RIFF' + uint32 */
-            if ((off_t)rsize > remsize)
-                rsize = remsize;
-        }
-        /* Dump RIFF stream: */
-        LOG("%sEntry %5zu", cfg.verbose?"":"\r", id);
-        dump(pfx, id, riff, rsize);
-        /* Skip to next segment: */
-        ++id;
-        riff = next;
-        remsize = riff ? fsize - (riff - mfile) : 0;
+        tb_take(&wr_bucket, n);
+        p += n;
+        len -= n;
     }
-    munmap((void *)mfile, fsize);
-    return id;
+    if (0 != write_out(STDOUT_FILENO, p, len))
+        goto err;
+    pthread_mutex_unlock(&stdout_mtx);
+    return 0;
+err:
+    pthread_mutex_unlock(&stdout_mtx);
+    LOG("Failed to write frame %s: %s\n", name, strerror(errno));
+    return -1;
 }
 
-int main(int argc, char *argv[]) {
-    int i, total, argidx = 1;
-    const char *odir;
-    struct stat st;
+/*
+ * Per input file job context:
+ */
+typedef struct {
+    const struct config *opt;   /* options for this input */
+    const wwnames_t *names;     /* media names, or NULL */
+    const char *input;          /* input file name */
+    FILE *man;                  /* per input manifest stream, or NULL */
+    int fd;                     /* input file, or -1 if not mapped */
+    unsigned *pending;          /* its streams queued for writing */
+    struct ixpkg *ix;           /* its index entry, or NULL */
+} job_t;
 
-    argidx = config(argc, argv);
-    if (argc - argidx < 1)
-        usage(argv[0]);
+/*
+ * Write the stream e, located in the mapped input file b, to file fd.
+ * The data is copied in the kernel straight from the input file, if
+ * possible: copy_file_range() may even share the data blocks on file
+ * systems supporting reflinks, sendfile() serves other kinds of output.
+ */
+static int copy_out(int fd, const job_t *job, const void *b,
+                    const riffscan_entry_t *e) {
+    off_t offs = e->offs;
+    size_t len = e->len, n;
+    ssize_t got = 0;
+    struct stat st;
 
-    /* If the last argument does not designate an existing file, we
-     * attempt to interpret it as the name of the output directory: */
-    if (0 != stat(argv[argc - 1], &st) || S_ISDIR(st.st_mode)) {
-        odir = argv[--argc];
-        if (argc - argidx < 1)
-            usage(argv[0]);
-    }
-    else
-        odir = "output";
-    LOG("Using \"%s\" as output directory\n", odir);
-    i = stat(odir, &st);
-    if (0 != i) {
-        LOG("Creating \"%s\"\n", odir);
-        mkdirp(odir, 0755);
-        i = stat(odir, &st);
-    }
-    if (0 != i || !S_ISDIR(st.st_mode)) {
-        LOG("%s is not a valid output directory\n", odir);
-        exit(EXIT_FAILURE);
+    if (job->fd >= 0 && cfg.write_method == WRITE_COPY && 0 == fstat(fd, &st)) {
+        while (len > 0) {
+            n = wr_bucket.rate > 0 && len > THROTTLE_CHUNK ? THROTTLE_CHUNK : len;
+            got = S_ISREG(st.st_mode)
+                  ? copy_file_range(job->fd, &offs, fd, NULL, n, 0)
+                  : sendfile(fd, job->fd, &offs, n);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                break;
+            tb_take(&wr_bucket, got);
+            len -= got;
+        }
+        if (got < 0 && errno != EINVAL && errno != EXDEV && errno != ENOSYS
+            && errno != EOPNOTSUPP)
+            return -1;
     }
+    /* Whatever could not be copied in the kernel: */
+    return write_out(fd, (const uint8_t *)b + offs, len);
+}
 
-    /* Loop over remaining arguments as input files: */
-    for (total = 0, i = argidx; i < argc; i++) {
-        int fd, cnt, n;
-        char fpfx[PATH_MAX], tfn[PATH_MAX], *x;
+/*
+ * Write the samples of a PCM stream, len bytes at p, preceded by the
+ * WAVE header hdr and followed by a padding byte if needed, to fd.  The
+ * samples are written straight from the input file mapping.
+ */
+static int wave_out(int fd, const uint8_t *hdr, const uint8_t *p, size_t len) {
+    static const uint8_t pad;
+    struct iovec iov[3] = {
+        { (void *)hdr, WAVE_HEADER_SIZE },
+        { (void *)p, len },
+        { (void *)&pad, len & 1 },
+    };
+    struct iovec *v = iov;
+    int cnt = 3;
+    ssize_t n;
 
-        fd = -1;
-        if (0 == stat(argv[i], &st)) {
-            if (S_ISREG(st.st_mode))
-                fd = open(argv[i], O_RDONLY);
-            else
-                errno = ENOTSUP;
+    if (wr_bucket.rate > 0)
+        return write_all(fd, hdr, WAVE_HEADER_SIZE) || write_out(fd, p, len)
+               || write_all(fd, &pad, len & 1) ? -1 : 0;
+    while (cnt > 0) {
+        n = writev(fd, v, cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
         }
-        if (fd < 0){
-            LOG("Skipping %s (failed to open: %s)\n", argv[i], strerror(errno));
-            continue;
+        for (; cnt > 0 && (size_t)n >= v->iov_len; --cnt)
+            n -= v++->iov_len;
+        if (cnt > 0) {
+            v->iov_base = (uint8_t *)v->iov_base + n;
+            v->iov_len -= n;
         }
-
-        LOG("Processing %s\n", argv[i]);
-        strcpy(tfn, argv[i]);
-        if ( NULL != (x = strrchr(tfn, '.')))
+    }
+    return 0;
+}
+
+/* IMA ADPCM blocks decoded at a time: */
+#define DECODE_BLOCKS   256
+
+/*
+ * Decode the IMA ADPCM stream w at p, straight from the input file
+ * mapping, and write it to fd as 16 bit PCM, preceded by the WAVE
+ * header hdr, see wave_ima_pcm().
+ */
+static int decode_out(int fd, const uint8_t *hdr, const wave_t *w, const uint8_t *p) {
+    size_t ba = w->block_align, nblocks = w->data_len / ba, n, len;
+    const uint8_t *d = p + w->data_offs;
+    wave_t one = *w, pcm;
+    int16_t *buf;
+    int err;
+
+    /* Decoded size of one block: */
+    one.data_len = ba;
+    if (0 != wave_ima_pcm(&one, &pcm)
+        || !(buf = malloc(DECODE_BLOCKS * pcm.data_len)))
+        return -1;
+    err = write_all(fd, hdr, WAVE_HEADER_SIZE);
+    for (; !err && nblocks > 0; nblocks -= n, d += n * ba) {
+        n = nblocks < DECODE_BLOCKS ? nblocks : DECODE_BLOCKS;
+        len = n * pcm.data_len;
+        wave_ima_decode(w, d, n, buf);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        for (size_t i = 0; i < len / 2; ++i)
+            buf[i] = (int16_t)__builtin_bswap16((uint16_t)buf[i]);
+#endif
+        err = write_out(fd, buf, len);
+    }
+    free(buf);
+    return err;
+}
+
+/* How dump_stream() writes a stream: */
+enum { AS_IS, NORMALIZED, DECODED };
+
+static int stream_out(int fd, const job_t *job, const void *b, const riffscan_entry_t *e,
+                      int how, const uint8_t *hdr, const wave_t *w) {
+    const uint8_t *p = (const uint8_t *)b + e->offs;
+
+    switch (how) {
+    case NORMALIZED:
+        return wave_out(fd, hdr, p + w->data_offs, w->data_len);
+    case DECODED:
+        return decode_out(fd, hdr, w, p);
+    }
+    return copy_out(fd, job, b, e);
+}
+
+/*
+ * Create file of and write the stream e, located in the mapped input
+ * file b, to it, see stream_out().
+ */
+static int write_file(const char *of, const job_t *job, const void *b,
+                      const riffscan_entry_t *e, int how, const uint8_t *hdr,
+                      const wave_t *w) {
+    int fd;
+
+    tb_take(&file_bucket, 1);
+    /* Caveat: This will overwrite any existing file with the same name! */
+    fd = create_file(of);
+    if (0 > fd){
+        LOG("Failed to create %s: %s\n", of, strerror(errno));
+        return -1;
+    }
+    if (0 != stream_out(fd, job, b, e, how, hdr, w)) {
+        LOG("Failed to write %s: %s\n", of, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    return 0;
+}
+
+/*
+ * Record stream e, written to of, in the manifest(s), if any, along with
+ * the name of its input file.  Called by workers and stripe writers
+ * alike, stdio locking keeps the lines whole.
+ */
+static void manifest_add(const job_t *job, const riffscan_entry_t *e,
+                         const char *of) {
+    if (manifest_fp)
+        fprintf(manifest_fp, "%s\t%zu\t%zu\t%s\n", job->input, e->offs, e->len, of);
+    if (job->man)
+        fprintf(job->man, "%s\t%zu\t%zu\t%s\n", job->input, e->offs, e->len, of);
+}
+
+/* Count stream e as written, or as an error: */
+static void dump_done(int err, const riffscan_entry_t *e) {
+    if (err) {
+        stat_add(&stats.errors, 1);
+    }
+    else {
+        stat_add(&stats.streams_written, 1);
+        stat_add(&stats.bytes_written, e->len);
+    }
+}
+
+/*
+ * Output striping:  With cfg.stripe set, streams are spread over the
+ * output roots cfg.odir and cfg.stripe[].  Each device holding a root
+ * has a queue of its own, served by cfg.stripe_writers threads, so the
+ * devices are written in parallel while the workers go on scanning.
+ * Queued streams still point into the input mapping, which the jobs
+ * must not unmap before stripe_drain() returns.
+ */
+typedef struct wreq {
+    struct wreq *next;
+    job_t job;
+    const void *b;              /* mapped input file */
+    riffscan_entry_t e;
+    int how;                    /* see stream_out() */
+    uint8_t hdr[WAVE_HEADER_SIZE];
+    wave_t w;
+    size_t root;
+    char of[];
+} wreq_t;
+
+typedef struct {
+    dev_t dev;
+    wreq_t *head, **tail;
+    size_t len;                 /* requests queued or being written */
+    uint64_t bytes;             /* stream bytes queued or being written */
+    pthread_cond_t more;        /* signalled when a request is queued */
+} wqueue_t;
+
+/* Requests queued per device before the workers have to wait: */
+#define STRIPE_QUEUE_MAX    64
+
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t done;        /* signalled when a request is done */
+    const char **root;          /* cfg.odir, then cfg.stripe[] */
+    wqueue_t **rootq;           /* the queue of each root's device */
+    uint64_t *root_streams, *root_bytes;
+    size_t nroots;
+    wqueue_t *q;
+    size_t nq;
+    size_t next;                /* next root, round robin */
+    int quit;
+    pthread_t *tid;
+    size_t ntid;
+} stripe = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL,
+    NULL,
+    NULL, NULL,
+    0,
+    NULL,
+    0,
+    0,
+    0,
+    NULL,
+    0,
+};
+
+/* Tell whether the streams of job go through the stripe queues: */
+static inline int striped(const job_t *job) {
+    return stripe.nroots && job->pending
+           && 0 == strcmp(job->opt->odir, cfg.odir);
+}
+
+/*
+ * Pick the output root for a stream of len bytes, and account for it
+ * in the queue of its device right away, so concurrent picks see it.
+ */
+static size_t stripe_pick(size_t len) {
+    size_t r, i;
+
+    pthread_mutex_lock(&stripe.mtx);
+    r = stripe.next++ % stripe.nroots;
+    if (cfg.stripe_by == STRIPE_SIZE) {
+        /* The least loaded device, starting after the last pick so
+         * roots sharing a device take turns: */
+        for (i = 1; i < stripe.nroots; ++i) {
+            size_t k = (r + i) % stripe.nroots;
+            if (stripe.rootq[k]->bytes < stripe.rootq[r]->bytes)
+                r = k;
+        }
+    }
+    stripe.rootq[r]->bytes += len;
+    pthread_mutex_unlock(&stripe.mtx);
+    return r;
+}
+
+/*
+ * Queue stream e for writing to file of, below root r as picked by
+ * stripe_pick().  Waits while the queue of the device is full.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int stripe_submit(size_t r, const char *of, const job_t *job,
+                         const void *b, const riffscan_entry_t *e, int how,
+                         const uint8_t *hdr, const wave_t *w) {
+    wqueue_t *q = stripe.rootq[r];
+    wreq_t *rq = malloc(sizeof *rq + strlen(of) + 1);
+
+    pthread_mutex_lock(&stripe.mtx);
+    if (!rq) {
+        q->bytes -= e->len;
+        pthread_mutex_unlock(&stripe.mtx);
+        LOG("Out of memory\n");
+        return -1;
+    }
+    rq->next = NULL;
+    rq->job = *job;
+    rq->b = b;
+    rq->e = *e;
+    rq->how = how;
+    if (how != AS_IS) {
+        memcpy(rq->hdr, hdr, sizeof rq->hdr);
+        rq->w = *w;
+    }
+    rq->root = r;
+    strcpy(rq->of, of);
+    while (q->len >= STRIPE_QUEUE_MAX)
+        pthread_cond_wait(&stripe.done, &stripe.mtx);
+    ++q->len;
+    ++*job->pending;
+    *q->tail = rq;
+    q->tail = &rq->next;
+    pthread_cond_signal(&q->more);
+    pthread_mutex_unlock(&stripe.mtx);
+    return 0;
+}
+
+/* Wait until all streams queued by job are written: */
+static void stripe_drain(const job_t *job) {
+    if (!stripe.nroots || !job->pending)
+        return;
+    pthread_mutex_lock(&stripe.mtx);
+    while (*job->pending)
+        pthread_cond_wait(&stripe.done, &stripe.mtx);
+    pthread_mutex_unlock(&stripe.mtx);
+}
+
+static void *stripe_writer(void *arg) {
+    wqueue_t *q = arg;
+    wreq_t *rq;
+    int err;
+
+    pthread_mutex_lock(&stripe.mtx);
+    for (;;) {
+        while (!q->head && !stripe.quit)
+            pthread_cond_wait(&q->more, &stripe.mtx);
+        if (!q->head)
+            break;
+        rq = q->head;
+        if (!(q->head = rq->next))
+            q->tail = &q->head;
+        pthread_mutex_unlock(&stripe.mtx);
+        err = write_file(rq->of, &rq->job, rq->b, &rq->e, rq->how, rq->hdr, &rq->w);
+        if (!err)
+            manifest_add(&rq->job, &rq->e, rq->of);
+        dump_done(err, &rq->e);
+        pthread_mutex_lock(&stripe.mtx);
+        if (!err) {
+            ++stripe.root_streams[rq->root];
+            stripe.root_bytes[rq->root] += rq->e.len;
+        }
+        --q->len;
+        q->bytes -= rq->e.len;
+        --*rq->job.pending;
+        pthread_cond_broadcast(&stripe.done);
+        free(rq);
+    }
+    pthread_mutex_unlock(&stripe.mtx);
+    return NULL;
+}
+
+static int check_odir(const char *odir);
+
+/*
+ * Set up the output roots and a queue for each device holding any of
+ * them, and start the writers, with all signals blocked in them.
+ * Returns 0 on success, -1 on error.
+ */
+static int stripe_start(void) {
+    size_t n = cfg.nstripe + 1, i, k;
+    sigset_t all, old;
+    struct stat st;
+    int err;
+
+    stripe.root = calloc(n, sizeof *stripe.root);
+    stripe.rootq = calloc(n, sizeof *stripe.rootq);
+    stripe.root_streams = calloc(n, sizeof *stripe.root_streams);
+    stripe.root_bytes = calloc(n, sizeof *stripe.root_bytes);
+    stripe.q = calloc(n, sizeof *stripe.q);
+    stripe.tid = calloc(n * cfg.stripe_writers, sizeof *stripe.tid);
+    if (!stripe.root || !stripe.rootq || !stripe.root_streams
+        || !stripe.root_bytes || !stripe.q || !stripe.tid) {
+        LOG("Out of memory\n");
+        return -1;
+    }
+    stripe.root[0] = cfg.odir;
+    for (i = 1; i < n; ++i) {
+        stripe.root[i] = cfg.stripe[i - 1];
+        if (0 != check_odir(stripe.root[i]))
+            return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        if (0 != stat(stripe.root[i], &st)) {
+            LOG("Failed to stat %s: %s\n", stripe.root[i], strerror(errno));
+            return -1;
+        }
+        for (k = 0; k < stripe.nq && stripe.q[k].dev != st.st_dev; ++k)
+            ;
+        if (k == stripe.nq) {
+            stripe.q[k].dev = st.st_dev;
+            stripe.q[k].tail = &stripe.q[k].head;
+            pthread_cond_init(&stripe.q[k].more, NULL);
+            ++stripe.nq;
+        }
+        stripe.rootq[i] = &stripe.q[k];
+    }
+    stripe.nroots = n;
+    LOG("Striping output over %zu roots on %zu devices\n", stripe.nroots, stripe.nq);
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (k = 0; k < stripe.nq; ++k) {
+        for (i = 0; i < cfg.stripe_writers; ++i) {
+            err = pthread_create(&stripe.tid[stripe.ntid], NULL,
+                                 stripe_writer, &stripe.q[k]);
+            if (err) {
+                LOG("Failed to start writer thread: %s\n", strerror(err));
+                exit(EXIT_FAILURE);
+            }
+            ++stripe.ntid;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return 0;
+}
+
+/* Stop the writers once their queues ran dry, and report: */
+static void stripe_finish(void) {
+    if (!stripe.nroots)
+        return;
+    pthread_mutex_lock(&stripe.mtx);
+    stripe.quit = 1;
+    for (size_t k = 0; k < stripe.nq; ++k)
+        pthread_cond_broadcast(&stripe.q[k].more);
+    pthread_mutex_unlock(&stripe.mtx);
+    for (size_t i = 0; i < stripe.ntid; ++i)
+        pthread_join(stripe.tid[i], NULL);
+    for (size_t i = 0; i < stripe.nroots; ++i)
+        LOG("%s: %llu streams, %llu bytes\n", stripe.root[i],
+            (unsigned long long)stripe.root_streams[i],
+            (unsigned long long)stripe.root_bytes[i]);
+}
+
+/* dump_stream() result for a stream left to the stripe writers: */
+#define STREAM_QUEUED   1
+
+/*
+ * Dump RIFF stream.
+ * Write the stream described by e, located in the mapped input file b,
+ * to a file whose name is constructed from prefix, a label (may be
+ * empty), a numeric id and a suffix.  Once written, the stream is
+ * recorded in the manifest(s), if any, see manifest_add().  With
+ * normalize set, PCM streams are written with a canonical WAVE header,
+ * with decode set, IMA ADPCM streams are decoded to PCM.  Striped
+ * streams get the prefix below their output root, and are queued.
+ */
+static inline int dump_stream(const job_t *job, const char *prefix, size_t id,
+                       const char *lab, const void *b, const riffscan_entry_t *e) {
+    int fd;
+    const char *suffix[] = {"riff", "rifx"};  /* dump filename suffix */
+    const uint8_t *p = (const uint8_t *)b + e->offs;
+    const char *sfx = suffix[e->endianess];
+    const char *root = "";
+    size_t r = 0;
+    uint8_t hdr[WAVE_HEADER_SIZE];
+    wave_t w, pcm;
+    int how = AS_IS;
+
+    /* 64 bit variants keep their own suffix: */
+    if (e->len >= 4 && !memcmp(p, "RF64", 4))
+        sfx = "rf64";
+    else if (e->len >= 4 && !memcmp(p, "BW64", 4))
+        sfx = "bw64";
+    if (!cfg.stdout_frames && (job->opt->normalize || job->opt->decode)
+        && 0 == wave_parse(&w, p, e->len, e->endianess)) {
+        if (job->opt->decode && 0 == wave_ima_pcm(&w, &pcm)
+            && 0 == wave_header(&pcm, hdr))
+            how = DECODED;
+        else if (job->opt->normalize && 0 == wave_header(&w, hdr))
+            how = NORMALIZED;
+    }
+    if (how != AS_IS)
+        sfx = "wav";
+    if (striped(job)) {
+        r = stripe_pick(e->len);
+        root = stripe.root[r];
+        prefix += strlen(cfg.odir);
+    }
+
+    char of[strlen(root) + strlen(prefix) + strlen(lab) + 255];
+    /* Construct file name from prefix and label or id or offset: */
+    if (job->opt->name_by_offset)
+        snprintf(of, sizeof of, "%s%s%s%s%012zx.%s",
+                    root, prefix, lab, *lab?"_":"", e->offs, sfx);
+    else
+        snprintf(of, sizeof of, "%s%s%s%s%06zu.%s",
+                    root, prefix, lab, *lab?"_":"", id, sfx);
+    if (cfg.verbose)
+        LOG(": %8zu -> %s\n", e->len, of);
+    if (cfg.stdout_frames) {
+        fd = frame(of, b, e);
+    }
+    else if (0 == strcmp(job->opt->odir, "-")) {
+        /* Raw stream data to stdout, one stream after the other: */
+        pthread_mutex_lock(&stdout_mtx);
+        fd = stream_out(STDOUT_FILENO, job, b, e, how, hdr, &w);
+        pthread_mutex_unlock(&stdout_mtx);
+        if (0 != fd)
+            LOG("Failed to write %s to stdout: %s\n", of, strerror(errno));
+    }
+    else if (*root) {
+        return stripe_submit(r, of, job, b, e, how, hdr, &w) ? -1 : STREAM_QUEUED;
+    }
+    else {
+        fd = write_file(of, job, b, e, how, hdr, &w);
+    }
+    if (0 == fd)
+        manifest_add(job, e, of);
+    return fd;
+}
+
+/*
+ * Stream index under construction, see riffidx.h: each job collects the
+ * streams of its input in an ixpkg_t, which it hands over to ix when it
+ * is done, and index_write() writes them all at the end.
+ */
+typedef struct ixpkg {
+    struct ixpkg *next;
+    char *name;                 /* input file path */
+    uint64_t size;              /* input file size */
+    riffidx_stream_t *s;        /* labels refer to lab */
+    size_t n, cap;
+    char *lab;                  /* null-terminated labels */
+    size_t lab_len, lab_cap;
+    int err;                    /* streams are missing */
+} ixpkg_t;
+
+static struct {
+    pthread_mutex_t mtx;
+    ixpkg_t *head;
+    size_t n;
+} ix = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 };
+
+static void index_free(ixpkg_t *p) {
+    free(p->name);
+    free(p->s);
+    free(p->lab);
+    free(p);
+}
+
+static ixpkg_t *index_pkg(const char *path, uint64_t size) {
+    ixpkg_t *p = calloc(1, sizeof *p);
+
+    if (p && !(p->name = strdup(path))) {
+        free(p);
+        p = NULL;
+    }
+    if (!p)
+        LOG("Out of memory\n");
+    else
+        p->size = size;
+    return p;
+}
+
+/* Add stream e, located in the mapped input file b, with label lab: */
+static int index_add(const job_t *job, const char *lab, const uint8_t *b,
+                     const riffscan_entry_t *e) {
+    ixpkg_t *p = job->ix;
+    riffidx_stream_t *s;
+    size_t ll = strlen(lab) + 1;
+
+    if (p->n == p->cap) {
+        size_t cap = p->cap ? 2 * p->cap : 256;
+        if (!(s = realloc(p->s, cap * sizeof *s)))
+            goto oom;
+        p->s = s;
+        p->cap = cap;
+    }
+    if (ll > 1 && p->lab_len + ll > p->lab_cap) {
+        size_t cap = p->lab_cap ? 2 * p->lab_cap : 4096;
+        char *l;
+        while (cap < p->lab_len + ll)
+            cap *= 2;
+        if (!(l = realloc(p->lab, cap)))
+            goto oom;
+        p->lab = l;
+        p->lab_cap = cap;
+    }
+    s = &p->s[p->n++];
+    s->offs = e->offs;
+    s->len = e->len;
+    s->hash = riffidx_xxh64(b + e->offs, e->len, 0);
+    s->label = RIFFIDX_NONE;
+    if (ll > 1) {
+        memcpy(p->lab + p->lab_len, lab, ll);
+        s->label = p->lab_len;
+        p->lab_len += ll;
+    }
+    if (cfg.verbose)
+        LOG(": %8zu -> %016llx %s\n", e->len, (unsigned long long)s->hash, lab);
+    return 0;
+oom:
+    LOG("Out of memory while indexing %s\n", job->input);
+    stat_add(&stats.errors, 1);
+    p->err = 1;
+    return -1;
+}
+
+/* Hand over the index entry of a job, which succeeded if ok is set.
+ * Incomplete entries are dropped, so the input is not indexed at all: */
+static void index_done(ixpkg_t *p, int ok) {
+    if (!p)
+        return;
+    if (!ok || p->err) {
+        LOG("%sNot indexing %s\n", sol, p->name);
+        index_free(p);
+        return;
+    }
+    pthread_mutex_lock(&ix.mtx);
+    p->next = ix.head;
+    ix.head = p;
+    ++ix.n;
+    pthread_mutex_unlock(&ix.mtx);
+}
+
+/* Tell whether stream e in the mapped input file b is a silent WAVE: */
+static int is_silent(const job_t *job, const uint8_t *b, const riffscan_entry_t *e) {
+    wave_t w;
+
+    return 0 == wave_parse(&w, b + e->offs, e->len, e->endianess)
+           && 1 == wave_silent(&w, b + e->offs, job->opt->silence_level);
+}
+
+/* Dump RIFF stream, or index it, unless it is silent and to be skipped,
+ * and keep count: */
+static inline int dump(const job_t *job, const char *prefix, size_t id,
+                       const char *lab, const void *b, const riffscan_entry_t *e) {
+    int err;
+
+    stat_add(&stats.streams_found, 1);
+    if (job->opt->silent && is_silent(job, b, e)) {
+        stat_add(&stats.streams_silent, 1);
+        if (job->opt->silent == SILENT_SKIP) {
+            if (cfg.verbose)
+                LOG(": %8zu silent, skipped\n", e->len);
+            return 0;
+        }
+    }
+    if (job->ix)
+        return index_add(job, lab, b, e);
+    err = dump_stream(job, prefix, id, lab, b, e);
+    if (err == STREAM_QUEUED)
+        return 0;
+    dump_done(err, e);
+    return err;
+}
+
+/*
+ * Media names loaded from SoundbanksInfo files, shared by all jobs:
+ */
+typedef struct names_cache {
+    struct names_cache *next;
+    const char *path;
+    wwnames_t names;
+} names_cache_t;
+
+static names_cache_t *names_cache;
+static pthread_mutex_t names_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Load the media names from a Wwise SoundbanksInfo.{xml,json,txt} file,
+ * or look them up in the cache if the file was loaded before.
+ * Returns NULL on failure.
+ */
+static const wwnames_t *load_names(const char *path) {
+    int fd = -1, err = -1;
+    struct stat st;
+    char *txt = NULL;
+    names_cache_t *nc;
+
+    pthread_mutex_lock(&names_mtx);
+    for (nc = names_cache; nc; nc = nc->next)
+        if (0 == strcmp(nc->path, path))
+            goto found;
+    nc = calloc(1, sizeof *nc);
+    if (!nc)
+        goto out;
+    nc->path = path;
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || 0 != fstat(fd, &st))
+        goto out;
+    txt = malloc(st.st_size + 1);
+    if (!txt)
+        goto out;
+    errno = 0;
+    if (st.st_size != read(fd, txt, st.st_size)) {
+        if (errno == 0)
+            errno = EIO;
+        goto out;
+    }
+    txt[st.st_size] = '\0';
+    err = wwnames_load(&nc->names, txt);
+out:
+    if (err) {
+        LOG("Failed to load names from %s: %s\n", path, strerror(errno));
+        if (nc)
+            wwnames_free(&nc->names);
+        free(nc);
+        nc = NULL;
+    }
+    else {
+        LOG("Loaded %zu media names from %s\n", nc->names.cnt, path);
+        nc->next = names_cache;
+        names_cache = nc;
+    }
+    free(txt);
+    if (fd >= 0)
+        close(fd);
+found:
+    pthread_mutex_unlock(&names_mtx);
+    return nc ? &nc->names : NULL;
+}
+
+/*
+ * Determine the label to use in the file name of the stream e:
+ * the media name looked up by the stream's media ID, or the ID itself,
+ * or, if requested, a label extracted from the stream data.
+ */
+static const char *stream_label(const job_t *job, const wwindex_t *idx,
+                                const uint8_t *b, const riffscan_entry_t *e,
+                                char *lab) {
+    const char *name;
+    uint64_t mid;
+
+    *lab = '\0';
+    if (idx->cnt && wwindex_get(idx, e->offs, &mid)) {
+        name = wwnames_get(job->names, mid);
+        if (name)
+            return name;
+        snprintf(lab, RIFFSCAN_LABEL_MAX + 1, "%llu", (unsigned long long)mid);
+        return lab;
+    }
+    if (job->opt->use_label)
+        labl(b + e->offs, e->len, e->endianess, lab);
+    return lab;
+}
+
+/*
+ * Collect the holes of a sparse file, so the scanner can skip them.
+ * Returns the number of holes found, the array stored in *holes must
+ * be released by the caller.
+ */
+static size_t find_holes(int fd, off_t fsize, riffscan_range_t **holes) {
+    riffscan_range_t *h = NULL, *t;
+    size_t n = 0, cap = 0;
+    off_t hole, data = 0;
+
+    *holes = NULL;
+    while (data < fsize) {
+        hole = lseek(fd, data, SEEK_HOLE);
+        if (hole < 0 || hole >= fsize)
+            break;
+        data = lseek(fd, hole, SEEK_DATA);
+        if (data < 0)
+            data = fsize;   /* ENXIO: hole extends to end of file */
+        if (n == cap) {
+            cap = cap ? cap * 2 : 16;
+            t = realloc(h, cap * sizeof *h);
+            if (!t)
+                break;
+            h = t;
+        }
+        h[n].start = hole;
+        h[n].end = data;
+        ++n;
+    }
+    *holes = h;
+    return n;
+}
+
+/*
+ * Compressed input formats, identified by their magic bytes, and the
+ * commands used to decompress them from stdin to stdout:
+ */
+static const struct {
+    const char *magic;
+    size_t mlen;
+    const char *suffix;
+    const char *cmd[4];
+} decomp[] = {
+    { "\x28\xb5\x2f\xfd", 4, ".zst", { "zstd", "-dcq", NULL } },
+    { "\xfd" "7zXZ", 6, ".xz", { "xz", "-dcq", "-T0", NULL } },
+    { "\x1f\x8b", 2, ".gz", { "gzip", "-dcq", NULL } },
+    { "BZh", 3, ".bz2", { "bzip2", "-dcq", NULL } },
+};
+
+/*
+ * If the data m of n bytes starts like a file compressed in one of the
+ * known formats, return its index in decomp[], else -1.
+ */
+static int compressed_buf(const uint8_t *m, ssize_t n) {
+    for (size_t i = 0; i < sizeof decomp / sizeof *decomp; ++i)
+        if (n >= (ssize_t)decomp[i].mlen && !memcmp(m, decomp[i].magic, decomp[i].mlen))
+            return i;
+    return -1;
+}
+
+/* Likewise for the file fd: */
+static int compressed(int fd) {
+    uint8_t m[8];
+    return compressed_buf(m, pread(fd, m, sizeof m, 0));
+}
+
+/*
+ * A decompressor running as a child process, see decompress():
+ */
+typedef struct {
+    int fmt;                    /* index in decomp[] */
+    pid_t pid;                  /* or 0 once it is done */
+    int pidfd;                  /* to wait for it, or -1 */
+    int state;                  /* last decomp_pump() result */
+    size_t size;                /* output so far */
+    size_t limit;               /* most output allowed */
+} decomp_t;
+
+/* Rescan the output of a decompressor whenever it grew by this much: */
+#define DECOMP_STEP     ((size_t)64 << 20)
+/* Check on a running decompressor this often: */
+#define DECOMP_POLL_MS  20
+
+/* Forget the decompressor d, which was reaped: */
+static void decomp_done(decomp_t *d) {
+    d->pid = 0;
+    if (d->pidfd >= 0)
+        close(d->pidfd);
+    d->pidfd = -1;
+}
+
+/*
+ * Wait a little for more output of the decompressor d in the memory
+ * file mfd, and update d->size.  Returns 1 while the decompressor is
+ * running, 0 when it is done, or -1 if it failed or its output exceeds
+ * d->limit, which is reported.  Once it returned 0 or -1, it keeps
+ * returning that.
+ */
+static int decomp_pump(decomp_t *d, int mfd) {
+    struct pollfd pfd = { d->pidfd, POLLIN, 0 };
+    struct timespec ts = { 0, DECOMP_POLL_MS * 1000000L };
+    struct stat st;
+    int status = 0, err = 0;
+    pid_t n;
+
+    if (!d->pid)
+        return d->state;
+    if (d->pidfd >= 0)
+        poll(&pfd, 1, DECOMP_POLL_MS);
+    else
+        nanosleep(&ts, NULL);
+    while (0 > (n = waitpid(d->pid, &status, WNOHANG)) && errno == EINTR)
+        ;
+    if (n < 0)
+        err = errno;
+    if (0 != fstat(mfd, &st))
+        err = errno;
+    else
+        d->size = st.st_size;
+    if (n == 0) {
+        if (!err)
+            return d->state = 1;
+        kill(d->pid, SIGTERM);
+        while (0 > (n = waitpid(d->pid, &status, 0)) && errno == EINTR)
+            ;
+    }
+    decomp_done(d);
+    if (d->size >= d->limit)
+        LOG("%sDecompressed data exceeds %zu MiB, half of memory and swap, giving up\n",
+            sol, d->limit >> 20);
+    else if (err || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        LOG("%sDecompression with %s failed%s%s\n", sol, decomp[d->fmt].cmd[0],
+                err ? ": " : "", err ? strerror(err) : "");
+    else
+        return d->state = 0;
+    return d->state = -1;
+}
+
+/*
+ * Start decompressing file fd into an anonymous memory file, which is
+ * returned in place of fd, and wait for the first output.  fd is closed.
+ * The decompressor runs as a child process writing straight into the
+ * memory file, so no temporary file is written to disk and the memory
+ * file can be mapped like any input, even while it still grows, see
+ * follow_decomp().  As the memory file must fit in memory and swap, it
+ * may take at most half of them.  Returns -1 if decompression failed
+ * before producing any output.
+ */
+static int decompress(decomp_t *d, int fd, int fmt, const char *name) {
+    int mfd;
+    char mname[64];
+    const char *base = strrchr(name, '/');
+    struct sysinfo si;
+    struct rlimit rl;
+
+    d->fmt = fmt;
+    d->pid = 0;
+    d->pidfd = -1;
+    d->state = -1;
+    d->size = 0;
+    d->limit = SIZE_MAX;
+    if (0 == sysinfo(&si) && si.mem_unit)
+        d->limit = ((uint64_t)si.totalram + si.totalswap) / 2 * si.mem_unit;
+    rl.rlim_cur = rl.rlim_max = d->limit;
+    /* The name only shows in /proc, and is limited to 249 bytes: */
+    snprintf(mname, sizeof mname, "%s", base ? base + 1 : name);
+    mfd = memfd_create(mname, MFD_CLOEXEC);
+    if (mfd < 0) {
+        LOG("Failed to set up decompression: %s\n", strerror(errno));
+        goto fail;
+    }
+    d->pid = fork();
+    if (d->pid < 0) {
+        LOG("fork failed: %s\n", strerror(errno));
+        d->pid = 0;
+        goto fail;
+    }
+    if (d->pid == 0) {
+        if (0 > dup2(fd, STDIN_FILENO) || 0 > dup2(mfd, STDOUT_FILENO))
+            _exit(127);
+        /* Writes past the limit fail with EFBIG instead of a signal: */
+        signal(SIGXFSZ, SIG_IGN);
+        setrlimit(RLIMIT_FSIZE, &rl);
+        /* No stdio here, another thread may hold its locks. */
+        execvp(decomp[fmt].cmd[0], (char *const *)decomp[fmt].cmd);
+        _exit(127);
+    }
+#ifdef SYS_pidfd_open
+    d->pidfd = syscall(SYS_pidfd_open, d->pid, 0);
+#endif
+    close(fd);
+    fd = -1;
+    while (0 < decomp_pump(d, mfd) && d->size == 0)
+        ;
+    if (d->state < 0 && d->size == 0)
+        goto fail;
+    return mfd;
+fail:
+    if (mfd >= 0)
+        close(mfd);
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+/* Stop the decompressor d, if it is still running: */
+static void decomp_stop(decomp_t *d) {
+    if (!d->pid)
+        return;
+    kill(d->pid, SIGTERM);
+    while (0 > waitpid(d->pid, NULL, 0) && errno == EINTR)
+        ;
+    decomp_done(d);
+}
+
+static size_t carve(const job_t *job, const char *pfx, const uint8_t *mfile,
+                    size_t base, riffscan_t *scan, const wwindex_t *idx,
+                    unsigned depth);
+
+/*
+ * Dump stream e number id, located in the mapped input file mfile.
+ * With cfg.recurse set, also carve the streams nested inside of it, up
+ * to cfg.recurse levels deep, straight from the mapping.  The names of
+ * nested streams are prefixed with the index of their parent stream.
+ * Returns the number of streams dumped.
+ */
+static size_t carve_entry(const job_t *job, const char *pfx,
+                          const uint8_t *mfile, size_t id,
+                          const riffscan_entry_t *e, const wwindex_t *idx,
+                          unsigned depth) {
+    size_t cnt = 1;
+    char lab[RIFFSCAN_LABEL_MAX + 1];
+
+    /* Dump RIFF stream: */
+    if (cfg.verbose)
+        LOG("Entry %5zu", id);
+    dump(job, pfx, id, stream_label(job, idx, mfile, e, lab), mfile, e);
+    /* Look inside, skipping the stream header: */
+    if (depth < job->opt->recurse && e->len > 16) {
+        riffscan_t inner;
+        char ipfx[strlen(pfx) + 32];
+
+        snprintf(ipfx, sizeof ipfx, "%s%06zu-", pfx, id);
+        riffscan_init(&inner, mfile + e->offs + 8, e->len - 8);
+        inner.guess_length = job->opt->guess_length;
+        inner.skip_inner = 1;
+        cnt += carve(job, ipfx, mfile, e->offs + 8, &inner, idx, depth + 1);
+    }
+    return cnt;
+}
+
+/*
+ * Dump the streams found by scan, which covers the part of the mapped
+ * input file mfile starting at offset base, see carve_entry().
+ * Returns the number of streams dumped.
+ */
+static size_t carve(const job_t *job, const char *pfx, const uint8_t *mfile,
+                    size_t base, riffscan_t *scan, const wwindex_t *idx,
+                    unsigned depth) {
+    size_t id, cnt;
+    riffscan_entry_t e;
+
+    for (id = cnt = 0; riffscan_next(scan, &e); ++id) {
+        e.offs += base;
+        cnt += carve_entry(job, pfx, mfile, id, &e, idx, depth);
+    }
+    return cnt;
+}
+
+/* Set up scanner s for the input image mfile of fsize bytes: */
+static void scan_setup(riffscan_t *s, const job_t *job, const uint8_t *mfile,
+                       size_t fsize) {
+    riffscan_init(s, mfile, fsize);
+    s->guess_length = job->opt->guess_length;
+    s->align = job->opt->align;
+    s->start = job->opt->range_start;
+    s->limit = job->opt->range_end;
+    s->skip_inner = job->opt->recurse > 0;
+    s->progress = scan_progress;
+}
+
+/*
+ * Traverse the input image mfile of fsize bytes, with nholes holes,
+ * and dump anything that looks like a RIFF stream.
+ */
+static int extract_image(const job_t *job, const char *pfx,
+                         const uint8_t *mfile, size_t fsize,
+                         const riffscan_range_t *holes, size_t nholes) {
+    size_t cnt;
+    riffscan_t scan;
+    wwindex_t idx = { NULL, 0, 0, 0 };
+
+    scan_setup(&scan, job, mfile, fsize);
+    scan.nholes = nholes;
+    scan.holes = holes;
+    if (cfg.verbose && scan.nholes)
+        LOG("Skipping %zu holes in sparse file\n", scan.nholes);
+    if (job->names) {
+        wwindex_build(&idx, mfile, fsize);
+        if (idx.err)
+            LOG("Out of memory while indexing media IDs\n");
+        if (cfg.verbose)
+            LOG("Found %zu media IDs in container index\n", idx.cnt);
+    }
+    cnt = carve(job, pfx, mfile, 0, &scan, &idx, 0);
+    wwindex_free(&idx);
+    if (cfg.verbose && job->opt->align == RIFFSCAN_ALIGN_AUTO)
+        LOG("Inferred alignment: %zu\n", riffscan_stride(&scan));
+    return cnt;
+}
+
+/*
+ * Map file fd of fsize bytes and extract the streams from it.
+ */
+static int extract(int fd, off_t fsize, const job_t *job, const char *pfx) {
+    int cnt;
+    const uint8_t *mfile;
+    riffscan_range_t *holes;
+    size_t nholes;
+
+    if (fsize == 0)
+        return 0;
+    mfile = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mfile == MAP_FAILED) {
+        LOG("mmap failed: %s\n", strerror(errno));
+        return -1;
+    }
+    nholes = find_holes(fd, fsize, &holes);
+    cnt = extract_image(job, pfx, mfile, fsize, holes, nholes);
+    free(holes);
+    stripe_drain(job);
+    munmap((void *)mfile, fsize);
+    return cnt;
+}
+
+/*
+ * Dump the streams in the first fsize bytes of the growing input mfile
+ * from offset *resume on, numbering them from *id on.  Unless final is
+ * set, stop at the first stream that is not completely available yet.
+ * Updates *resume and *id for the next round.
+ * Returns the number of streams dumped.
+ */
+static int follow_scan(const job_t *job, const char *pfx, const uint8_t *mfile,
+                       size_t fsize, size_t *resume, size_t *id, int final) {
+    riffscan_t scan;
+    riffscan_entry_t e;
+    wwindex_t idx = { NULL, 0, 0, 0 };
+    int cnt = 0;
+
+    scan_setup(&scan, job, mfile, fsize);
+    if (scan.start < *resume)
+        scan.start = *resume;
+    /* The container index usually comes first, but may still grow: */
+    if (job->names)
+        wwindex_build(&idx, mfile, fsize);
+    while (riffscan_next(&scan, &e)) {
+        if (!final && (job->opt->guess_length ? e.offs + e.len >= fsize
+                : riffscan_len(mfile + e.offs, fsize - e.offs, e.endianess) > fsize - e.offs)) {
+            *resume = e.offs;
+            break;
+        }
+        cnt += carve_entry(job, pfx, mfile, (*id)++, &e, &idx, 0);
+        *resume = scan.skip_inner ? e.offs + e.len : e.offs + 4;
+    }
+    wwindex_free(&idx);
+    return cnt;
+}
+
+/*
+ * Tell whether file path is open for writing, as far as we can tell:
+ * a read lease is refused for such files.  Returns 1 if it is, 0 if it
+ * is not, and -1 if leases are unavailable, e.g. for files of other
+ * users.
+ */
+static int being_written(const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY), busy = -1;
+
+    if (fd < 0)
+        return -1;
+    if (0 == fcntl(fd, F_SETLEASE, F_RDLCK)) {
+        fcntl(fd, F_SETLEASE, F_UNLCK);
+        busy = 0;
+    }
+    else if (errno == EAGAIN)
+        busy = 1;
+    close(fd);
+    return busy;
+}
+
+/*
+ * Follow the input file fd, which is still being written to at path:
+ * whenever it grew, dump the streams that have become complete, until
+ * the writer closes the file or it did not grow for cfg.follow_timeout
+ * seconds.  Then dump whatever is left, like extract() would.  A file
+ * nobody has open for writing is dumped at once.
+ */
+static int follow(int fd, const char *path, const job_t *job, const char *pfx) {
+    int ifd, n, final = 0, cnt = 0;
+    size_t resume = 0, id = 0, fsize = 0;
+    const uint8_t *mfile = NULL;
+    struct stat st;
+    struct pollfd pfd;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    ifd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (ifd < 0 || 0 > inotify_add_watch(ifd, path, IN_MODIFY | IN_CLOSE_WRITE)) {
+        LOG("Failed to watch %s: %s\n", path, strerror(errno));
+        final = 1;
+    }
+    else if (0 == being_written(path))
+        final = 1;
+    for (;;) {
+        if (0 != fstat(fd, &st) || (size_t)st.st_size < fsize) {
+            LOG("%s shrunk or vanished while following it\n", path);
+            break;
+        }
+        if ((size_t)st.st_size > fsize || final) {
+            stripe_drain(job);
+            if (mfile)
+                munmap((void *)mfile, fsize);
+            mfile = NULL;
+            fsize = st.st_size;
+            if (fsize) {
+                mfile = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (mfile == MAP_FAILED) {
+                    LOG("mmap failed: %s\n", strerror(errno));
+                    mfile = NULL;
+                    cnt = -1;
+                    break;
+                }
+                cnt += follow_scan(job, pfx, mfile, fsize, &resume, &id, final);
+            }
+        }
+        if (final)
+            break;
+        pfd.fd = ifd;
+        pfd.events = POLLIN;
+        n = poll(&pfd, 1, cfg.follow_timeout * 1000);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (cfg.verbose && n == 0)
+                LOG("\n%s idle for %u seconds\n", path, cfg.follow_timeout);
+            final = 1;
+            continue;
+        }
+        while (0 < (n = read(ifd, buf, sizeof buf))) {
+            for (char *p = buf; p < buf + n; ) {
+                const struct inotify_event *ev = (const void *)p;
+                p += sizeof *ev + ev->len;
+                if (ev->mask & (IN_CLOSE_WRITE | IN_IGNORED))
+                    final = 1;
+            }
+        }
+    }
+    stripe_drain(job);
+    if (mfile)
+        munmap((void *)mfile, fsize);
+    if (ifd >= 0)
+        close(ifd);
+    return cnt;
+}
+
+/*
+ * Dump the streams in the output of the decompressor d, the memory file
+ * mfd, as they become complete, like follow() does for growing files,
+ * so that scanning overlaps decompression.  The output is rescanned
+ * whenever it grew by DECOMP_STEP bytes.  If it is too large, the
+ * streams not yet complete are given up on.
+ */
+static int follow_decomp(decomp_t *d, int mfd, const job_t *job, const char *pfx) {
+    size_t resume = 0, id = 0, fsize = 0;
+    const uint8_t *mfile = NULL;
+    int cnt = 0, n = d->state;
+
+    for (;;) {
+        while (n > 0 && d->size - fsize < DECOMP_STEP)
+            n = decomp_pump(d, mfd);
+        if (n < 0) {
+            stat_add(&stats.errors, 1);
+            if (d->size >= d->limit)
+                break;
+        }
+        stripe_drain(job);
+        if (mfile)
+            munmap((void *)mfile, fsize);
+        mfile = NULL;
+        fsize = d->size;
+        if (fsize) {
+            mfile = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, mfd, 0);
+            if (mfile == MAP_FAILED) {
+                LOG("mmap failed: %s\n", strerror(errno));
+                mfile = NULL;
+                cnt = -1;
+                break;
+            }
+            cnt += follow_scan(job, pfx, mfile, fsize, &resume, &id, n <= 0);
+        }
+        if (n <= 0)
+            break;
+    }
+    decomp_stop(d);
+    stripe_drain(job);
+    if (mfile)
+        munmap((void *)mfile, fsize);
+    return cnt;
+}
+
+/*
+ * Entries to extract, read from cfg.entries_file:
+ */
+typedef struct {
+    enum { SEL_RANGE, SEL_ID, SEL_NAME } kind;
+    const char *input;      /* only from this input file, or NULL */
+    uint64_t offs, len;     /* SEL_RANGE, len 0: take it from the header */
+    uint64_t id;            /* SEL_ID */
+    const char *name;       /* SEL_NAME */
+    atomic_bool found;      /* set once found in any input */
+} entry_sel_t;
+
+static entry_sel_t *entries;
+static size_t nentries;
+
+/*
+ * Read the list of entries to extract from path, one per line:
+ *
+ *   OFFSET:LENGTH      the given byte range
+ *   OFFSET:            the stream starting at OFFSET
+ *   ID                 the stream with this Wwise media ID
+ *   NAME               the stream with this media name, see --names
+ *
+ * Offsets and lengths may carry a K, M, G or T suffix.  Manifest lines,
+ * as written by --manifest, select the listed range from the listed
+ * input file.  Blank lines and lines starting with '#' are ignored.
+ * Returns 0 on success, -1 on error.
+ */
+static int load_entries(const char *path) {
+    FILE *fp;
+    char *line = NULL, *l, *f[3], *colon;
+    size_t lsize = 0, cap = 0;
+    unsigned lno = 0;
+    entry_sel_t *e;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        LOG("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (0 < getline(&line, &lsize, fp)) {
+        ++lno;
+        l = trim(line);
+        if (!*l || *l == '#')
+            continue;
+        if (nentries == cap) {
+            cap = cap ? cap * 2 : 64;
+            if (!(e = realloc(entries, cap * sizeof *e)))
+                goto nomem;
+            entries = e;
+        }
+        e = memset(&entries[nentries], 0, sizeof *e);
+        if (strchr(l, '\t')) {
+            /* Manifest line: input, offset, length, output name */
+            f[0] = strtok(l, "\t");
+            f[1] = strtok(NULL, "\t");
+            f[2] = strtok(NULL, "\t");
+            if (!f[2] || 0 != parse_size(f[1], &e->offs)
+                || 0 != parse_size(f[2], &e->len) || !e->len)
+                goto syntax;
+            if (!(e->input = strdup(f[0])))
+                goto nomem;
+            e->kind = SEL_RANGE;
+        }
+        else if (NULL != (colon = strchr(l, ':'))
+                 && (*colon = '\0', 0 == parse_size(l, &e->offs))) {
+            if (colon[1] && (0 != parse_size(colon + 1, &e->len) || !e->len))
+                goto syntax;
+            e->kind = SEL_RANGE;
+        }
+        else {
+            if (colon)
+                *colon = ':';
+            e->kind = SEL_NAME;
+            for (f[0] = l; isdigit((unsigned char)*f[0]); ++f[0])
+                ;
+            if (!*f[0]) {
+                e->kind = SEL_ID;
+                e->id = strtoull(l, NULL, 10);
+            }
+            else if (!(e->name = strdup(l)))
+                goto nomem;
+        }
+        ++nentries;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+syntax:
+    LOG("%s:%u: invalid entry\n", path, lno);
+    goto fail;
+nomem:
+    LOG("Out of memory\n");
+fail:
+    free(line);
+    fclose(fp);
+    return -1;
+}
+
+/*
+ * Fill in e for the stream starting at offset offs of the mapped input
+ * mfile of fsize bytes, unless there is none.
+ * Returns 0 on success, -1 if there is no stream at offs.
+ */
+static int stream_at(const uint8_t *mfile, size_t fsize, size_t offs,
+                     riffscan_entry_t *e) {
+    uint64_t len;
+
+    if (offs >= fsize || fsize - offs <= 8)
+        return -1;
+    if (riffscan_is_sig(mfile + offs, riffscan_sigs[0]))
+        e->endianess = 0;
+    else if (riffscan_is_sig(mfile + offs, riffscan_sigs[1]))
+        e->endianess = 1;
+    else
+        return -1;
+    e->offs = offs;
+    len = riffscan_len(mfile + offs, fsize - offs, e->endianess);
+    e->len = len > fsize - offs ? fsize - offs : (size_t)len;
+    return 0;
+}
+
+/*
+ * Dump the entries listed in cfg.entries_file from the file fd of fsize
+ * bytes.  Nothing is scanned, only the container index is read if media
+ * IDs or names are to be looked up.
+ * Returns the number of streams dumped.
+ */
+static int extract_entries(int fd, off_t fsize, const job_t *job, const char *pfx) {
+    const uint8_t *mfile;
+    wwindex_t idx = { NULL, 0, 0, 0 };
+    riffscan_entry_t e;
+    char lab[RIFFSCAN_LABEL_MAX + 1];
+    size_t i, k, id = 0;
+    int found;
+
+    if (fsize == 0)
+        return 0;
+    mfile = mmap(NULL, fsize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mfile == MAP_FAILED) {
+        LOG("mmap failed: %s\n", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < nentries; ++i)
+        if (entries[i].kind != SEL_RANGE || job->names) {
+            wwindex_build(&idx, mfile, fsize);
+            break;
+        }
+    for (i = 0; i < nentries; ++i) {
+        entry_sel_t *sel = &entries[i];
+
+        if (sel->input && 0 != strcmp(sel->input, job->input))
+            continue;
+        found = 0;
+        if (sel->kind == SEL_RANGE) {
+            if (sel->len) {
+                if (0 != stream_at(mfile, fsize, sel->offs, &e))
+                    e.endianess = 0;
+                e.offs = sel->offs;
+                e.len = sel->len;
+                if (e.offs >= (size_t)fsize || e.len > fsize - e.offs)
+                    e.len = 0;
+            }
+            else if (0 != stream_at(mfile, fsize, sel->offs, &e))
+                e.len = 0;
+            if (e.len) {
+                dump(job, pfx, id++, stream_label(job, &idx, mfile, &e, lab),
+                     mfile, &e);
+                found = 1;
+            }
+        }
+        for (k = 0; sel->kind != SEL_RANGE && k < idx.cnt; ++k) {
+            const char *name = job->names ? wwnames_get(job->names, idx.v[k].id) : NULL;
+
+            if (sel->kind == SEL_ID ? idx.v[k].id != sel->id
+                    : !name || 0 != strcmp(name, sel->name))
+                continue;
+            if (0 == stream_at(mfile, fsize, idx.v[k].offs, &e)) {
+                dump(job, pfx, id++, stream_label(job, &idx, mfile, &e, lab),
+                     mfile, &e);
+                found = 1;
+            }
+        }
+        if (found)
+            atomic_store_explicit(&sel->found, 1, memory_order_relaxed);
+        else if (!sel->input) {
+            if (sel->kind == SEL_RANGE)
+                LOG("%s: no stream at offset %llu\n", job->input,
+                    (unsigned long long)sel->offs);
+            else if (sel->kind == SEL_ID)
+                LOG("%s: no stream with media ID %llu\n", job->input,
+                    (unsigned long long)sel->id);
+            else
+                LOG("%s: no stream named %s\n", job->input, sel->name);
+        }
+    }
+    wwindex_free(&idx);
+    stripe_drain(job);
+    munmap((void *)mfile, fsize);
+    return id;
+}
+
+/* Number of selected entries not found in any input: */
+static size_t entries_missing(void) {
+    size_t i, n = 0;
+
+    for (i = 0; i < nentries; ++i)
+        if (!atomic_load_explicit(&entries[i].found, memory_order_relaxed))
+            ++n;
+    return n;
+}
+
+/* Inputs up to this size are read instead of mapped: */
+#define SMALL_FILE_MAX  (1 << 20)
+
+/*
+ * Read the small file fd of size bytes into a buffer that is reused for
+ * all small inputs processed by the calling thread.  For thousands of
+ * tiny files this is a lot cheaper than setting up a mapping for each.
+ * The file offset is left alone.  Returns NULL on failure.
+ */
+static const uint8_t *read_small(int fd, size_t size) {
+    static __thread uint8_t *buf;
+    size_t got = 0;
+    ssize_t n;
+
+    if (!buf && !(buf = malloc(SMALL_FILE_MAX)))
+        return NULL;
+    while (got < size) {
+        n = pread(fd, buf + got, size - got, got);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n == 0)
+                errno = EIO;    /* truncated under our feet */
+            return NULL;
+        }
+        got += n;
+    }
+    return buf;
+}
+
+/*
+ * 32 bit FNV-1a hash, used to tell inputs apart independent of their
+ * position on the command line.
+ */
+static uint32_t fnv1a(const char *s) {
+    uint32_t h = 0x811c9dc5;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 0x01000193;
+    }
+    return h;
+}
+
+typedef struct {
+    size_t idx;         /* paths index */
+    uint32_t hash;      /* path hash */
+    uint64_t size;      /* input file size */
+} shard_in_t;
+
+static int shard_cmp(const void *a, const void *b) {
+    const shard_in_t *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/*
+ * Mark the n inputs in paths that belong to our shard in sel.
+ * By default an input belongs to shard (path hash mod n).  With
+ * shard_by_size the inputs are sorted by descending size and each is
+ * assigned to the shard with the least total size so far, which is
+ * deterministic as long as all shards see the same list of inputs.
+ * Returns 0 on success, -1 if out of memory.
+ */
+static int select_shard(const char *const *paths, size_t n, char *sel) {
+    shard_in_t *in;
+    uint64_t *load;
+    struct stat st;
+    size_t i;
+    unsigned k;
+
+    if (!cfg.shard_by_size) {
+        for (i = 0; i < n; ++i)
+            sel[i] = fnv1a(paths[i]) % cfg.shard_n == cfg.shard_k;
+        return 0;
+    }
+    in = malloc(n * sizeof *in + 1);
+    load = calloc(cfg.shard_n, sizeof *load);
+    if (!in || !load) {
+        LOG("Out of memory\n");
+        free(in);
+        free(load);
+        return -1;
+    }
+    for (i = 0; i < n; ++i) {
+        in[i].idx = i;
+        in[i].hash = fnv1a(paths[i]);
+        in[i].size = 0 == stat(paths[i], &st) ? (uint64_t)st.st_size : 0;
+    }
+    qsort(in, n, sizeof *in, shard_cmp);
+    for (i = 0; i < n; ++i) {
+        unsigned best = 0;
+        for (k = 1; k < cfg.shard_n; ++k)
+            if (load[k] < load[best])
+                best = k;
+        load[best] += in[i].size + 1;
+        sel[in[i].idx] = best == cfg.shard_k;
+    }
+    free(in);
+    free(load);
+    return 0;
+}
+
+/* Total number of streams dumped so far: */
+static long total;
+static pthread_mutex_t total_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Construct the output prefix for input name in buf, where fmt is the
+ * index of its compression format in decomp[] or -1, and ord is its
+ * ordinal among the inputs.  Returns the length of the prefix, or -1
+ * if it does not fit.
+ */
+static int out_prefix(const struct config *opt, const char *name, int fmt,
+                      int ord, char *buf, size_t size) {
+    char tfn[PATH_MAX], *x;
+    int n;
+
+    if (strlen(name) >= sizeof tfn)
+        return -1;
+    strcpy(tfn, name);
+    if (fmt >= 0) {
+        /* Strip the compression suffix, too: */
+        x = strrchr(tfn, '.');
+        if (x && 0 == strcmp(x, decomp[fmt].suffix))
             *x = 0;
-        if (cfg.use_basename) {
-            x = strrchr(tfn, '/');
-            x = x ? x + 1 : tfn;
-            n = snprintf(fpfx, sizeof fpfx, "%s/%03d_%s_", odir, i - argidx, x);
+    }
+    if ( NULL != (x = strrchr(tfn, '.')))
+        *x = 0;
+    if (opt->use_basename) {
+        x = strrchr(tfn, '/');
+        x = x ? x + 1 : tfn;
+        /* Sharded runs and spool directories must not depend on the
+         * argument position: */
+        if (cfg.shard_n || cfg.watch_dir)
+            n = snprintf(buf, size, "%s/%08x_%s_",
+                         opt->odir, (unsigned)fnv1a(name), x);
+        else
+            n = snprintf(buf, size, "%s/%03d_%s_", opt->odir, ord, x);
+    }
+    else {
+        n = snprintf(buf, size, "%s/%s/", opt->odir, tfn);
+    }
+    return (size_t)n < size ? n : -1;
+}
+
+/*
+ * Write the completion marker for prefix pfx, i.e. the prefix minus its
+ * trailing separator plus ".done", holding the manifest lines in man.
+ * The marker is renamed into place, so it is never seen half written.
+ */
+static int write_marker(const char *pfx, const char *man, size_t len) {
+    char mfn[PATH_MAX], tmp[PATH_MAX];
+    int fd, n = strlen(pfx) - 1;
+
+    snprintf(mfn, sizeof mfn, "%.*s.done", n, pfx);
+    snprintf(tmp, sizeof tmp, "%.*s.done.tmp", n, pfx);
+    fd = create_file(tmp);
+    if (fd < 0 || 0 != write_all(fd, man, len) || 0 != close(fd)
+        || 0 != rename(tmp, mfn)) {
+        LOG("Failed to write %s: %s\n", mfn, strerror(errno));
+        if (fd >= 0)
+            unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Extract the streams from input file path, which is called name in
+ * the output, using the options opt.  ord is the ordinal of the input.
+ */
+static void process(const struct config *opt, const char *path,
+                    const char *name, int ord) {
+    int fd, fmt, cnt = -1;
+    char fpfx[PATH_MAX];
+    struct stat st;
+    unsigned pending = 0;
+    job_t job = { opt, NULL, path, NULL, -1, &pending, NULL };
+    char *man = NULL;
+    size_t mlen = 0;
+    const uint8_t *small = NULL;
+    decomp_t dc = { -1, 0, -1, 0, 0, 0 };
+
+    /* Do not block on FIFOs, we refuse anything but regular files: */
+    fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+    if (fd >= 0) {
+        int err = 0 != fstat(fd, &st) ? errno : S_ISREG(st.st_mode) ? 0 : ENOTSUP;
+        if (err) {
+            close(fd);
+            fd = -1;
+            errno = err;
+        }
+    }
+    if (fd < 0){
+        LOG("%sSkipping %s (failed to open: %s)\n", sol, path, strerror(errno));
+        stat_add(&stats.errors, 1);
+        return;
+    }
+    /* Pages spliced into a pipe by frame() must not be reused, hence
+     * no small file buffer with --stdout-frames: */
+    if (st.st_size <= SMALL_FILE_MAX && !cfg.stdout_frames && !cfg.follow
+        && !cfg.entries_file && !(small = read_small(fd, st.st_size))) {
+        LOG("%sSkipping %s (failed to read: %s)\n", sol, path, strerror(errno));
+        stat_add(&stats.errors, 1);
+        close(fd);
+        return;
+    }
+    fmt = small ? compressed_buf(small, st.st_size) : compressed(fd);
+    if (0 > out_prefix(opt, name, fmt, ord, fpfx, sizeof fpfx)) {
+        LOG("%sSkipping %s (output path too long)\n", sol, path);
+        stat_add(&stats.errors, 1);
+        close(fd);
+        return;
+    }
+    if (cfg.watch_dir) {
+        char mfn[PATH_MAX];
+        struct stat ms;
+
+        /* Skip inputs completed since they were last modified: */
+        snprintf(mfn, sizeof mfn, "%.*s.done", (int)strlen(fpfx) - 1, fpfx);
+        if (0 == stat(mfn, &ms) && (ms.st_mtim.tv_sec > st.st_mtim.tv_sec
+            || (ms.st_mtim.tv_sec == st.st_mtim.tv_sec
+                && ms.st_mtim.tv_nsec >= st.st_mtim.tv_nsec))) {
+            if (cfg.verbose)
+                LOG("%sSkipping %s (already done)\n", sol, path);
+            close(fd);
+            return;
+        }
+        job.man = open_memstream(&man, &mlen);
+    }
+
+    LOG("%sProcessing %s\n", sol, path);
+    if (opt->names_file && !(job.names = load_names(opt->names_file)))
+        goto out;
+    /* Packages are indexed by their size as found, even if compressed: */
+    if (cfg.index_file && !(job.ix = index_pkg(path, st.st_size)))
+        goto out;
+    if (fmt >= 0) {
+        LOG("%sDecompressing with %s\n", sol, decomp[fmt].cmd[0]);
+        fd = decompress(&dc, fd, fmt, path);
+        if (fd >= 0) {
+            small = NULL;
+            /* The selected entries may be anywhere, wait for all of it: */
+            if (cfg.entries_file) {
+                while (0 < decomp_pump(&dc, fd))
+                    ;
+                if (dc.state < 0)
+                    stat_add(&stats.errors, 1);
+            }
+            if (0 != fstat(fd, &st))
+                goto out;
+        }
+        else {
+            /* The magic bytes may be a coincidence, e.g. "BZh" is
+             * just text, so fall back to the input as it is: */
+            LOG("%sProcessing %s as is\n", sol, path);
+            fmt = -1;
+            fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+            if (fd < 0 || (!small && 0 != fstat(fd, &st))) {
+                LOG("%sSkipping %s (failed to open: %s)\n", sol, path, strerror(errno));
+                goto out;
+            }
+        }
+    }
+    if (cfg.verbose)
+        LOG("Dumping to %s...\n", fpfx);
+    if (!small)
+        job.fd = fd;
+    if (cfg.entries_file)
+        cnt = extract_entries(fd, st.st_size, &job, fpfx);
+    else if (small)
+        cnt = st.st_size ? extract_image(&job, fpfx, small, st.st_size, NULL, 0) : 0;
+    else if (cfg.follow && fmt < 0)
+        cnt = follow(fd, path, &job, fpfx);
+    else if (fmt >= 0)
+        cnt = follow_decomp(&dc, fd, &job, fpfx);
+    else
+        cnt = extract(fd, st.st_size, &job, fpfx);
+    /* The small file buffer is reused by the next input: */
+    stripe_drain(&job);
+    LOG("%s%s %d entries from %s\n", sol, job.ix ? "Indexed" : "Dumped", cnt, path);
+    if (cnt > 0) {
+        pthread_mutex_lock(&total_mtx);
+        total += cnt;
+        pthread_mutex_unlock(&total_mtx);
+    }
+    if (job.man && 0 == fflush(job.man) && cnt >= 0 && !cfg.stdout_frames
+        && 0 != strcmp(opt->odir, "-"))
+        write_marker(fpfx, man, mlen);
+out:
+    if (cnt < 0)
+        stat_add(&stats.errors, 1);
+    decomp_stop(&dc);
+    index_done(job.ix, cnt >= 0);
+    if (fd >= 0)
+        close(fd);
+    if (job.man)
+        fclose(job.man);
+    free(man);
+}
+
+/*
+ * Worker pool: a queue of pending inputs served by cfg.threads threads.
+ */
+typedef struct task {
+    struct task *next;
+    struct task *hnext;     /* in pool.inflight, with --watch */
+    const struct config *opt;
+    char *path;
+    const char *name;   /* points into path */
+    int ord;
+    int running;        /* taken by a worker */
+    int again;          /* submitted again while running */
+} task_t;
+
+/*
+ * With --watch, the same file may be submitted again, by the startup
+ * scan and an event, or by several events, while it is still queued or
+ * processed.  Such tasks are kept in pool.inflight, so a file is never
+ * queued twice, nor processed by two workers at once: a file submitted
+ * while running is queued again once its worker is done.
+ */
+#define INFLIGHT_BUCKETS 1024
+
+static struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t more;    /* signalled when a task is queued */
+    pthread_cond_t idle;    /* signalled when a worker runs dry */
+    task_t *head, **tail;
+    unsigned busy;
+    int quit;
+    pthread_t *tid;
+    task_t *inflight[INFLIGHT_BUCKETS];
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    NULL, &pool.head,
+    0,
+    0,
+    NULL,
+    { NULL },
+};
+
+/* Append task t to the queue, with pool.mtx held: */
+static void pool_queue(task_t *t) {
+    t->next = NULL;
+    *pool.tail = t;
+    pool.tail = &t->next;
+    pthread_cond_signal(&pool.more);
+}
+
+/* Task t is done, with pool.mtx held; free it, unless it runs again: */
+static void pool_done(task_t *t) {
+    task_t **b;
+
+    t->running = 0;
+    if (t->again) {
+        t->again = 0;
+        stat_add(&stats.inputs_queued, 1);
+        pool_queue(t);
+        return;
+    }
+    if (cfg.watch_dir) {
+        for (b = &pool.inflight[fnv1a(t->path) % INFLIGHT_BUCKETS]; *b != t;
+             b = &(*b)->hnext)
+            ;
+        *b = t->hnext;
+    }
+    free(t->path);
+    free(t);
+}
+
+static void *worker(void *arg) {
+    task_t *t;
+
+    (void)arg;
+    pthread_mutex_lock(&pool.mtx);
+    for (;;) {
+        while (!pool.head && !pool.quit)
+            pthread_cond_wait(&pool.more, &pool.mtx);
+        if (!pool.head)
+            break;
+        t = pool.head;
+        if (!(pool.head = t->next))
+            pool.tail = &pool.head;
+        t->running = 1;
+        ++pool.busy;
+        pthread_mutex_unlock(&pool.mtx);
+        process(t->opt, t->path, t->name, t->ord);
+        stat_add(&stats.inputs_done, 1);
+        pthread_mutex_lock(&pool.mtx);
+        pool_done(t);
+        if (!--pool.busy && !pool.head)
+            pthread_cond_broadcast(&pool.idle);
+    }
+    pthread_mutex_unlock(&pool.mtx);
+    return NULL;
+}
+
+/* Start the workers, with all signals blocked in them: */
+static void pool_start(void) {
+    sigset_t all, old;
+    int err;
+
+    pool.tid = calloc(cfg.threads, sizeof *pool.tid);
+    if (!pool.tid) {
+        LOG("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (unsigned i = 0; i < cfg.threads; ++i) {
+        if (0 != (err = pthread_create(&pool.tid[i], NULL, worker, NULL))) {
+            LOG("Failed to start worker thread: %s\n", strerror(err));
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * Queue input path for processing with options opt, or process it right
+ * away if there is no pool.  The part of path starting at nameoffs is
+ * used to name the output.
+ */
+static void pool_submit(const struct config *opt, const char *path,
+                        size_t nameoffs, int ord) {
+    task_t *t, *q, **b;
+
+    if (!cfg.threads) {
+        stat_add(&stats.inputs_queued, 1);
+        process(opt, path, path + nameoffs, ord);
+        stat_add(&stats.inputs_done, 1);
+        return;
+    }
+    t = calloc(1, sizeof *t);
+    if (!t || !(t->path = strdup(path))) {
+        LOG("Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+    t->opt = opt;
+    t->name = t->path + nameoffs;
+    t->ord = ord;
+    pthread_mutex_lock(&pool.mtx);
+    if (cfg.watch_dir) {
+        b = &pool.inflight[fnv1a(path) % INFLIGHT_BUCKETS];
+        for (q = *b; q && 0 != strcmp(q->path, path); q = q->hnext)
+            ;
+        if (q) {
+            /* A queued task sees the latest data anyway: */
+            q->again |= q->running;
+            pthread_mutex_unlock(&pool.mtx);
+            free(t->path);
+            free(t);
+            return;
+        }
+        t->hnext = *b;
+        *b = t;
+    }
+    stat_add(&stats.inputs_queued, 1);
+    pool_queue(t);
+    pthread_mutex_unlock(&pool.mtx);
+}
+
+/* Wait for the queue to drain, then stop the workers: */
+static void pool_finish(void) {
+    if (!cfg.threads)
+        return;
+    pthread_mutex_lock(&pool.mtx);
+    while (pool.head || pool.busy)
+        pthread_cond_wait(&pool.idle, &pool.mtx);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.more);
+    pthread_mutex_unlock(&pool.mtx);
+    for (unsigned i = 0; i < cfg.threads; ++i)
+        pthread_join(pool.tid[i], NULL);
+    free(pool.tid);
+}
+
+/*
+ * Progress and metrics reporter thread: updates the progress line on
+ * stderr once per second, rewrites the metrics file every
+ * cfg.metrics_interval seconds and answers requests on the metrics
+ * socket, without ever getting in the way of the workers.
+ */
+static struct {
+    pthread_t tid;
+    int running;
+    int wake[2];        /* closing wake[1] stops the reporter */
+    int lfd;            /* listening metrics socket, or -1 */
+} rep = { 0, 0, { -1, -1 }, -1 };
+
+/* Format the metrics in the Prometheus text exposition format: */
+static size_t metrics_text(char *buf, size_t size) {
+    static const struct {
+        const char *name, *type, *help;
+        atomic_uint_fast64_t *val;
+    } m[] = {
+        { "bytes_scanned_total", "counter", "Input bytes scanned, including rescans.", &stats.bytes_scanned },
+        { "streams_found_total", "counter", "Streams found.", &stats.streams_found },
+        { "streams_written_total", "counter", "Streams written.", &stats.streams_written },
+        { "streams_silent_total", "counter", "Silent streams found.", &stats.streams_silent },
+        { "bytes_written_total", "counter", "Stream bytes written.", &stats.bytes_written },
+        { "errors_total", "counter", "Failed inputs and streams.", &stats.errors },
+        { "inputs_queued_total", "counter", "Input files queued.", &stats.inputs_queued },
+        { "inputs_done_total", "counter", "Input files processed.", &stats.inputs_done },
+    };
+    size_t len = 0;
+    uint64_t queued = stat_get(&stats.inputs_queued);
+    uint64_t done = stat_get(&stats.inputs_done);
+
+    for (size_t i = 0; i < sizeof m / sizeof *m && len < size; ++i)
+        len += snprintf(buf + len, size - len,
+                        "# HELP riffx_%s %s\n# TYPE riffx_%s %s\nriffx_%s %llu\n",
+                        m[i].name, m[i].help, m[i].name, m[i].type, m[i].name,
+                        (unsigned long long)stat_get(m[i].val));
+    if (len < size)
+        len += snprintf(buf + len, size - len,
+                        "# HELP riffx_inputs_pending Input files queued or in progress.\n"
+                        "# TYPE riffx_inputs_pending gauge\n"
+                        "riffx_inputs_pending %llu\n",
+                        (unsigned long long)(queued > done ? queued - done : 0));
+    return len < size ? len : size - 1;
+}
+
+/* Replace the metrics file, so readers never see it half written: */
+static void metrics_file(void) {
+    char buf[4096], tmp[PATH_MAX];
+    size_t len = metrics_text(buf, sizeof buf);
+    int fd;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", cfg.metrics_file);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0 || 0 != write_all(fd, buf, len) || 0 != close(fd)
+        || 0 != rename(tmp, cfg.metrics_file)) {
+        LOG("%sFailed to write %s: %s\n", sol, cfg.metrics_file, strerror(errno));
+        if (fd >= 0)
+            unlink(tmp);
+    }
+}
+
+/*
+ * Answer a client of the metrics socket.  HTTP requests, as sent e.g.
+ * by curl --unix-socket, get an HTTP response, anyone else just the
+ * metrics.
+ */
+static void metrics_serve(int cfd) {
+    char buf[4096], req[512];
+    struct pollfd pfd = { cfd, POLLIN, 0 };
+    size_t len = metrics_text(buf, sizeof buf);
+    ssize_t n = 0;
+    char hdr[128];
+
+    if (0 < poll(&pfd, 1, 100))
+        n = read(cfd, req, sizeof req);
+    if (n >= 4 && !memcmp(req, "GET ", 4)) {
+        int hlen = snprintf(hdr, sizeof hdr, "HTTP/1.0 200 OK\r\n"
+                "Content-Type: text/plain; version=0.0.4\r\n"
+                "Content-Length: %zu\r\n\r\n", len);
+        write_all(cfd, hdr, hlen);
+    }
+    write_all(cfd, buf, len);
+    close(cfd);
+}
+
+/* Format n bytes for humans: */
+static const char *human(uint64_t n, char *buf, size_t size) {
+    const char *unit = "KMGTPE";
+    double v = n;
+
+    if (n < 1024) {
+        snprintf(buf, size, "%llu B", (unsigned long long)n);
+        return buf;
+    }
+    while ((v /= 1024) >= 1024 && unit[1])
+        ++unit;
+    snprintf(buf, size, "%.1f %ciB", v, *unit);
+    return buf;
+}
+
+static void progress_line(void) {
+    char sc[32], wr[32];
+
+    LOG("\rScanned %s, found %llu streams, wrote %s, %llu of %llu inputs done\033[K",
+        human(stat_get(&stats.bytes_scanned), sc, sizeof sc),
+        (unsigned long long)stat_get(&stats.streams_found),
+        human(stat_get(&stats.bytes_written), wr, sizeof wr),
+        (unsigned long long)stat_get(&stats.inputs_done),
+        (unsigned long long)stat_get(&stats.inputs_queued));
+}
+
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void *reporter(void *arg) {
+    struct pollfd pfd[2];
+    int64_t now, next_line, next_file, t;
+    int cfd;
+
+    (void)arg;
+    now = now_ms();
+    next_line = now + 1000;
+    next_file = cfg.metrics_file ? now : INT64_MAX;
+    pfd[0].fd = rep.wake[0];
+    pfd[0].events = POLLIN;
+    pfd[1].fd = rep.lfd;
+    pfd[1].events = POLLIN;
+    for (;;) {
+        now = now_ms();
+        if (*sol && now >= next_line) {
+            progress_line();
+            next_line = now + 1000;
+        }
+        if (now >= next_file) {
+            metrics_file();
+            next_file = now + cfg.metrics_interval * 1000LL;
+        }
+        t = *sol ? next_line : next_file;
+        if (t > next_file)
+            t = next_file;
+        t = t == INT64_MAX ? -1 : t - now < 0 ? 0 : t - now;
+        if (0 > poll(pfd, rep.lfd >= 0 ? 2 : 1, (int)t) && errno != EINTR)
+            break;
+        if (pfd[0].revents)
+            break;
+        if (rep.lfd >= 0 && (pfd[1].revents & POLLIN)
+            && 0 <= (cfd = accept4(rep.lfd, NULL, NULL, SOCK_CLOEXEC)))
+            metrics_serve(cfd);
+    }
+    if (cfg.metrics_file)
+        metrics_file();
+    return NULL;
+}
+
+/*
+ * Start the reporter, if there is anything to report: the progress
+ * line is only shown on a terminal and not in verbose mode, where each
+ * stream is logged anyway.
+ */
+static void reporter_start(void) {
+    struct sockaddr_un sa;
+    sigset_t all, old;
+
+    if (!cfg.verbose && isatty(STDERR_FILENO))
+        sol = "\r\033[K";
+    if (!*sol && !cfg.metrics_file && !cfg.metrics_socket)
+        return;
+    if (cfg.metrics_socket) {
+        memset(&sa, 0, sizeof sa);
+        sa.sun_family = AF_UNIX;
+        if (strlen(cfg.metrics_socket) >= sizeof sa.sun_path) {
+            LOG("Socket path too long: %s\n", cfg.metrics_socket);
+            exit(EXIT_FAILURE);
+        }
+        strcpy(sa.sun_path, cfg.metrics_socket);
+        unlink(cfg.metrics_socket);
+        rep.lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (rep.lfd < 0 || 0 != bind(rep.lfd, (struct sockaddr *)&sa, sizeof sa)
+            || 0 != listen(rep.lfd, 8)) {
+            LOG("Failed to listen on %s: %s\n", cfg.metrics_socket, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (0 != pipe2(rep.wake, O_CLOEXEC)) {
+        LOG("pipe failed: %s\n", strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    rep.running = 0 == pthread_create(&rep.tid, NULL, reporter, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Stop the reporter, after a final update of the metrics file: */
+static void reporter_stop(void) {
+    if (!rep.running)
+        return;
+    close(rep.wake[1]);
+    pthread_join(rep.tid, NULL);
+    close(rep.wake[0]);
+    if (rep.lfd >= 0) {
+        close(rep.lfd);
+        unlink(cfg.metrics_socket);
+    }
+}
+
+/* Set by SIGINT and SIGTERM in watch mode: */
+static volatile sig_atomic_t stop;
+
+static void on_stop(int sig) {
+    (void)sig;
+    stop = 1;
+}
+
+/* Spool file names we never pick up: hidden, partial or our own. */
+static int spool_ignore(const char *name) {
+    size_t n = strlen(name);
+    return name[0] == '.' || (n > 5 && 0 == strcmp(name + n - 5, ".done"));
+}
+
+/* Submit all regular files in the spool directory, but those still
+ * being written, which are submitted by their close event: */
+static void spool_scan(void) {
+    DIR *d;
+    struct dirent *de;
+    char path[PATH_MAX];
+    size_t dlen = strlen(cfg.watch_dir) + 1;
+
+    if (!(d = opendir(cfg.watch_dir))) {
+        LOG("Failed to read %s: %s\n", cfg.watch_dir, strerror(errno));
+        return;
+    }
+    while (NULL != (de = readdir(d))) {
+        if (spool_ignore(de->d_name)
+            || (de->d_type != DT_REG && de->d_type != DT_UNKNOWN))
+            continue;
+        if ((size_t)snprintf(path, sizeof path, "%s/%s", cfg.watch_dir,
+                             de->d_name) >= sizeof path)
+            continue;
+        if (0 < being_written(path)) {
+            if (cfg.verbose)
+                LOG("%sSkipping %s (being written)\n", sol, path);
+            continue;
+        }
+        pool_submit(&cfg, path, dlen, 0);
+    }
+    closedir(d);
+}
+
+/*
+ * Watch the spool directory and process every file that is closed
+ * after writing or moved into it, until we are told to stop.  Files
+ * already present are processed first, unless they have been completed
+ * before.
+ */
+static void watch(void) {
+    struct sigaction sa;
+    char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    size_t dlen = strlen(cfg.watch_dir) + 1;
+    int ifd;
+    ssize_t n;
+
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = on_stop;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0 || 0 > inotify_add_watch(ifd, cfg.watch_dir,
+                                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_ONLYDIR)) {
+        LOG("Failed to watch %s: %s\n", cfg.watch_dir, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    LOG("Watching %s\n", cfg.watch_dir);
+    spool_scan();
+    while (!stop) {
+        n = read(ifd, buf, sizeof buf);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG("Failed to read events: %s\n", strerror(errno));
+            break;
+        }
+        for (char *p = buf; p < buf + n; ) {
+            const struct inotify_event *ev = (const void *)p;
+
+            p += sizeof *ev + ev->len;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                LOG("Event queue overflow, rescanning %s\n", cfg.watch_dir);
+                spool_scan();
+            }
+            if (!ev->len || (ev->mask & IN_ISDIR) || spool_ignore(ev->name))
+                continue;
+            if ((size_t)snprintf(path, sizeof path, "%s/%s", cfg.watch_dir,
+                                 ev->name) < sizeof path)
+                pool_submit(&cfg, path, dlen, 0);
+        }
+    }
+    LOG("%s\nStopping, waiting for pending inputs\n", sol);
+    close(ifd);
+}
+
+/*
+ * Check that the output directory odir exists, create it if necessary.
+ */
+static int check_odir(const char *odir) {
+    struct stat st;
+    int i;
+
+    if (cfg.stdout_frames)
+        return 0;
+    if (0 == strcmp(odir, "-")) {
+        if (isatty(STDOUT_FILENO)) {
+            LOG("Refusing to write streams to a terminal\n");
+            return -1;
+        }
+        return 0;
+    }
+    LOG("Using \"%s\" as output directory\n", odir);
+    i = stat(odir, &st);
+    if (0 != i) {
+        LOG("Creating \"%s\"\n", odir);
+        mkdirp(odir, 0755);
+        i = stat(odir, &st);
+    }
+    if (0 != i || !S_ISDIR(st.st_mode)) {
+        LOG("%s is not a valid output directory\n", odir);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * An input file queued for processing:
+ */
+typedef struct {
+    const struct config *opt;
+    const char *path;
+    int ord;            /* ordinal among the inputs of all jobs */
+    uint64_t size;
+} input_t;
+
+static int input_cmp(const void *a, const void *b) {
+    const input_t *x = a, *y = b;
+    if (x->size != y->size)
+        return x->size < y->size ? 1 : -1;
+    return strcmp(x->path, y->path);
+}
+
+/*
+ * Parse a yes/no job file value.
+ * Returns 0 on success, -1 on error.
+ */
+static int parse_bool(const char *s, int *val) {
+    if (0 == strcmp(s, "yes") || 0 == strcmp(s, "true") || 0 == strcmp(s, "1"))
+        *val = 1;
+    else if (0 == strcmp(s, "no") || 0 == strcmp(s, "false") || 0 == strcmp(s, "0"))
+        *val = 0;
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Read the job file path and append its inputs to *in, *nin.  Each job
+ * starts with a "[name]" line, followed by "key = value" lines:
+ *
+ *   input = FILE       input file, may be repeated
+ *   output = DIR       output directory
+ *   flat = yes|no      like -b
+ *   labels = yes|no    like -l
+ *   guess = yes|no     like -g
+ *   align = N|auto     like --align
+ *   names = FILE       like --names
+ *   range = START:END  like --range
+ *   recurse = N        like --recurse
+ *
+ * Options not given default to those on the command line.  Blank lines
+ * and lines starting with '#' or ';' are ignored.  The file is kept in
+ * memory, as the jobs refer to it.  Returns 0 on success, -1 on error.
+ */
+static int load_jobs(const char *path, input_t **in, size_t *nin) {
+    FILE *fp;
+    char *line = NULL, *key, *val;
+    size_t lsize = 0;
+    unsigned lno = 0;
+    struct config *job = NULL;
+    int ord = 0;
+
+    fp = fopen(path, "r");
+    if (!fp) {
+        LOG("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    while (0 < getline(&line, &lsize, fp)) {
+        ++lno;
+        key = trim(line);
+        if (!*key || *key == '#' || *key == ';')
+            continue;
+        if (*key == '[') {
+            if (!(job = malloc(sizeof *job)))
+                goto nomem;
+            *job = cfg;
+            continue;
+        }
+        val = strchr(key, '=');
+        if (!val || !job)
+            goto syntax;
+        *val++ = '\0';
+        key = trim(key);
+        if (!(val = strdup(trim(val))))
+            goto nomem;
+        if (0 == strcmp(key, "input")) {
+            input_t *p = realloc(*in, (*nin + 1) * sizeof **in);
+            struct stat st;
+            if (!p)
+                goto nomem;
+            *in = p;
+            p += (*nin)++;
+            p->opt = job;
+            p->path = val;
+            p->ord = ord++;
+            p->size = 0 == stat(val, &st) ? (uint64_t)st.st_size : 0;
+        }
+        else if (0 == strcmp(key, "output"))
+            job->odir = val;
+        else if (0 == strcmp(key, "names"))
+            job->names_file = val;
+        else if (0 == strcmp(key, "flat") ? parse_bool(val, &job->use_basename)
+                : 0 == strcmp(key, "labels") ? parse_bool(val, &job->use_label)
+                : 0 == strcmp(key, "guess") ? parse_bool(val, &job->guess_length)
+                : 0 == strcmp(key, "align") ? parse_align(val, &job->align)
+                : 0 == strcmp(key, "range") ? parse_range(val, job)
+                : 0 == strcmp(key, "recurse") ? parse_count(val, 64, &job->recurse)
+                : 0 == strcmp(key, "normalize") ? parse_bool(val, &job->normalize)
+                : 0 == strcmp(key, "decode") ? parse_bool(val, &job->decode)
+                : 0 == strcmp(key, "silent") ? parse_silent(val, &job->silent)
+                : 0 == strcmp(key, "silence-level") ? parse_level(val, &job->silence_level)
+                : -1)
+            goto syntax;
+    }
+    free(line);
+    fclose(fp);
+    return 0;
+syntax:
+    LOG("%s:%u: invalid job specification\n", path, lno);
+    goto fail;
+nomem:
+    LOG("Out of memory\n");
+fail:
+    free(line);
+    fclose(fp);
+    return -1;
+}
+
+/*
+ * Tuning profile:  riffx --calibrate runs short probes against the
+ * inputs and the output directory, and saves the best settings found,
+ * along with a fingerprint of the host, to the profile file, which
+ * later runs load automatically.  Options given on the command line
+ * win over the profile.  A run on a host that no longer matches the
+ * fingerprint ignores the profile, it never calibrates on its own.
+ *
+ * The scan probe maps up to CAL_SAMPLE_MAX bytes of the inputs and
+ * scans them in slices on 1, 2, 4, ... threads.  The write probe writes
+ * CAL_WRITE_BYTES in files the size of an average stream below the
+ * output directory, with either write method, on 1, 2, 4 and 8 threads,
+ * including the time it takes to get them onto the device.  The fewest
+ * threads within CAL_GOOD of the best rate win.  Since the workers
+ * write their own streams, the number of threads is the larger of the
+ * scan and write thread counts.
+ */
+#define CAL_SAMPLE_MAX      ((size_t)256 << 20)
+#define CAL_SLICE           ((size_t)4 << 20)
+#define CAL_WRITE_BYTES     ((size_t)32 << 20)
+#define CAL_GOOD            0.9
+#define CAL_MAX_THREADS     64
+#define CAL_MAX_WRITERS     8
+
+typedef struct {
+    long cpus;
+    unsigned long mem_gib;
+    uint32_t cpu_model;         /* hash of the CPU model name */
+    char dev[32];               /* output device, major:minor, for the record */
+    unsigned threads, stripe_writers;
+    int write_method;
+    double scan_rate, write_rate;   /* bytes/s, for the record */
+} profile_t;
+
+/* Fill in the fingerprint of this host, writing to odir (may be NULL): */
+static void host_fingerprint(profile_t *p, const char *odir) {
+    char line[256];
+    struct stat st;
+    FILE *fp;
+
+    memset(p, 0, sizeof *p);
+    p->cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    p->mem_gib = (unsigned long)((double)sysconf(_SC_PHYS_PAGES)
+                                 * sysconf(_SC_PAGESIZE) / (1 << 30) + 0.5);
+    if ((fp = fopen("/proc/cpuinfo", "r"))) {
+        while (fgets(line, sizeof line, fp)) {
+            if (0 == strncmp(line, "model name", 10)) {
+                p->cpu_model = fnv1a(line);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    if (odir && 0 == stat(odir, &st))
+        snprintf(p->dev, sizeof p->dev, "%u:%u",
+                 major(st.st_dev), minor(st.st_dev));
+}
+
+/* The output device is not compared, runs may write anywhere: */
+static int same_host(const profile_t *a, const profile_t *b) {
+    return a->cpus == b->cpus && a->mem_gib == b->mem_gib
+           && a->cpu_model == b->cpu_model;
+}
+
+/* The profile file to use, or NULL for none: */
+static const char *profile_path(char *buf, size_t size) {
+    const char *xdg = getenv("XDG_CONFIG_HOME"), *home = getenv("HOME");
+
+    if (cfg.profile)
+        return *cfg.profile ? cfg.profile : NULL;
+    if (xdg && *xdg)
+        snprintf(buf, size, "%s/riffx/profile", xdg);
+    else if (home && *home)
+        snprintf(buf, size, "%s/.config/riffx/profile", home);
+    else
+        return NULL;
+    return buf;
+}
+
+/*
+ * Load the profile at path into p.  Unknown keys are ignored.
+ * Returns 0 on success, -1 if there is no valid profile.
+ */
+static int profile_load(const char *path, profile_t *p) {
+    FILE *fp;
+    char *line = NULL, *key, *val;
+    size_t lsize = 0;
+    unsigned lno = 0, u;
+    int err = 0;
+
+    if (!(fp = fopen(path, "r"))) {
+        if (errno != ENOENT)
+            LOG("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    memset(p, 0, sizeof *p);
+    p->threads = cfg.threads;
+    p->stripe_writers = cfg.stripe_writers;
+    p->write_method = cfg.write_method;
+    while (!err && 0 < getline(&line, &lsize, fp)) {
+        ++lno;
+        key = trim(line);
+        if (!*key || *key == '#')
+            continue;
+        if (!(val = strchr(key, '='))) {
+            err = -1;
+            break;
+        }
+        *val++ = '\0';
+        key = trim(key);
+        val = trim(val);
+        if (0 == strcmp(key, "cpus"))
+            err = 1 == sscanf(val, "%ld", &p->cpus) ? 0 : -1;
+        else if (0 == strcmp(key, "memory-gib"))
+            err = 1 == sscanf(val, "%lu", &p->mem_gib) ? 0 : -1;
+        else if (0 == strcmp(key, "cpu-model"))
+            err = 1 == sscanf(val, "%x", &u) ? (p->cpu_model = u, 0) : -1;
+        else if (0 == strcmp(key, "output-device"))
+            snprintf(p->dev, sizeof p->dev, "%s", val);
+        else if (0 == strcmp(key, "threads"))
+            err = parse_count(val, 1024, &p->threads);
+        else if (0 == strcmp(key, "stripe-writers"))
+            err = parse_count(val, 64, &p->stripe_writers) || !p->stripe_writers ? -1 : 0;
+        else if (0 == strcmp(key, "write-method"))
+            err = parse_write_method(val, &p->write_method);
+    }
+    free(line);
+    fclose(fp);
+    if (err)
+        LOG("%s:%u: invalid profile setting\n", path, lno);
+    return err ? -1 : 0;
+}
+
+/* Save profile p to path, renamed into place.  Returns 0 or -1: */
+static int profile_save(const char *path, const profile_t *p) {
+    char tmp[PATH_MAX], dir[PATH_MAX], *x;
+    FILE *fp;
+
+    if ((size_t)snprintf(tmp, sizeof tmp, "%s.tmp", path) >= sizeof tmp) {
+        LOG("Profile path too long: '%s'\n", path);
+        return -1;
+    }
+    snprintf(dir, sizeof dir, "%s", path);
+    if ((x = strrchr(dir, '/')) && x != dir) {
+        *x = '\0';
+        mkdirp(dir, 0755);
+    }
+    if (!(fp = fopen(tmp, "w"))) {
+        LOG("Failed to create %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    fprintf(fp, "# riffx tuning profile, written by riffx --calibrate\n"
+                "# The host it is good for:\n"
+                "cpus = %ld\n"
+                "memory-gib = %lu\n"
+                "cpu-model = %08x\n"
+                "output-device = %s\n"
+                "# Settings, unless given on the command line:\n"
+                "threads = %u\n"
+                "stripe-writers = %u\n"
+                "write-method = %s\n"
+                "# Measured rates in bytes/s:\n"
+                "scan-rate = %.0f\n"
+                "write-rate = %.0f\n",
+            p->cpus, p->mem_gib, (unsigned)p->cpu_model, p->dev,
+            p->threads, p->stripe_writers,
+            p->write_method == WRITE_PLAIN ? "write" : "copy",
+            p->scan_rate, p->write_rate);
+    if (0 != fclose(fp) || 0 != rename(tmp, path)) {
+        LOG("Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* State shared by the probe threads: */
+static struct {
+    const uint8_t **slice;      /* scan probe slices, CAL_SLICE bytes */
+    size_t *slice_len, nslices;
+    atomic_uint_fast64_t streams, stream_bytes;
+    const char *dir;            /* write probe directory */
+    const uint8_t *src;         /* write probe data, from input srcfd */
+    int srcfd;
+    size_t srclen, fsize, nfiles;
+    atomic_int err;
+    atomic_size_t next;         /* next slice or file */
+} cal;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *cal_scan(void *arg) {
+    riffscan_t s;
+    riffscan_entry_t e;
+    size_t i;
+
+    (void)arg;
+    while ((i = atomic_fetch_add(&cal.next, 1)) < cal.nslices) {
+        riffscan_init(&s, cal.slice[i], cal.slice_len[i]);
+        while (riffscan_next(&s, &e)) {
+            stat_add(&cal.streams, 1);
+            stat_add(&cal.stream_bytes, e.len);
+        }
+    }
+    return NULL;
+}
+
+static void *cal_write(void *arg) {
+    job_t job = { &cfg, NULL, "calibrate", NULL, cal.srcfd, NULL, NULL };
+    riffscan_entry_t e = { 0, cal.fsize, 0 };
+    char path[PATH_MAX];
+    size_t i;
+    int fd;
+
+    (void)arg;
+    while ((i = atomic_fetch_add(&cal.next, 1)) < cal.nfiles) {
+        snprintf(path, sizeof path, "%s/%06zu", cal.dir, i);
+        e.offs = i * cal.fsize % (cal.srclen - cal.fsize + 1);
+        fd = create_file(path);
+        if (fd < 0 || 0 != copy_out(fd, &job, cal.src, &e))
+            atomic_store(&cal.err, errno ? errno : EIO);
+        if (fd >= 0)
+            close(fd);
+    }
+    return NULL;
+}
+
+/* Run fn on n threads, returning the seconds it took, or -1: */
+static double cal_run(void *(*fn)(void *), unsigned n) {
+    pthread_t tid[CAL_MAX_THREADS];
+    double t = now_s();
+    unsigned i;
+
+    atomic_store(&cal.next, 0);
+    for (i = 0; i < n; ++i)
+        if (0 != pthread_create(&tid[i], NULL, fn, NULL))
+            break;
+    if (i == 0)
+        return -1;
+    while (i-- > 0)
+        pthread_join(tid[i], NULL);
+    return now_s() - t;
+}
+
+/* Time writing cal.nfiles files to cal.dir on n threads, in bytes/s: */
+static double cal_write_rate(int method, unsigned n) {
+    char path[PATH_MAX];
+    double t;
+    int dfd;
+
+    if ((dfd = open(cal.dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+        return -1;
+    cfg.write_method = method;
+    atomic_store(&cal.err, 0);
+    syncfs(dfd);
+    t = now_s();
+    if (cal_run(cal_write, n) < 0 || atomic_load(&cal.err))
+        t = -1;
+    else if (0 != syncfs(dfd))
+        t = -1;
+    else
+        t = now_s() - t;
+    close(dfd);
+    for (size_t i = 0; i < cal.nfiles; ++i) {
+        snprintf(path, sizeof path, "%s/%06zu", cal.dir, i);
+        unlink(path);
+    }
+    return t > 0 ? cal.nfiles * cal.fsize / t : -1;
+}
+
+/*
+ * Measure the best settings for scanning the inputs in[] and writing
+ * to cfg.odir, and put them into p.  Returns 0 on success, -1 on error.
+ */
+static int calibrate(const input_t *in, size_t nin, profile_t *p) {
+    const uint8_t *map[nin ? nin : 1];
+    size_t maplen[nin ? nin : 1], nmap = 0, total = 0, i;
+    int fds[nin ? nin : 1], err = -1, method = cfg.write_method;
+    unsigned cand[8], ncand = 0, max_threads, best_t = 1, w, best_w = 1;
+    double rate[CAL_MAX_THREADS + 1], best, r;
+    char dir[PATH_MAX];
+    struct stat st;
+
+    LOG("Calibrating, this takes a few seconds\n");
+    /* Map a sample of the uncompressed inputs: */
+    for (i = 0; i < nin && total < CAL_SAMPLE_MAX; ++i) {
+        int fd = open(in[i].path, O_RDONLY | O_CLOEXEC | O_NONBLOCK | O_NOCTTY);
+        size_t len;
+
+        if (fd < 0)
+            continue;
+        if (0 != fstat(fd, &st) || !S_ISREG(st.st_mode) || !st.st_size
+            || compressed(fd) >= 0) {
+            close(fd);
+            continue;
+        }
+        len = (size_t)st.st_size < CAL_SAMPLE_MAX - total
+              ? (size_t)st.st_size : CAL_SAMPLE_MAX - total;
+        map[nmap] = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map[nmap] == MAP_FAILED) {
+            close(fd);
+            continue;
+        }
+        maplen[nmap] = len;
+        fds[nmap++] = fd;
+        total += len;
+    }
+    if (!nmap) {
+        LOG("No input data to calibrate with\n");
+        return -1;
+    }
+    cal.nslices = 0;
+    for (i = 0; i < nmap; ++i)
+        cal.nslices += (maplen[i] + CAL_SLICE - 1) / CAL_SLICE;
+    cal.slice = calloc(cal.nslices, sizeof *cal.slice);
+    cal.slice_len = calloc(cal.nslices, sizeof *cal.slice_len);
+    if (!cal.slice || !cal.slice_len) {
+        LOG("Out of memory\n");
+        goto out;
+    }
+    cal.nslices = 0;
+    for (i = 0; i < nmap; ++i) {
+        for (size_t o = 0; o < maplen[i]; o += CAL_SLICE) {
+            cal.slice[cal.nslices] = map[i] + o;
+            cal.slice_len[cal.nslices++] = maplen[i] - o < CAL_SLICE
+                                           ? maplen[i] - o : CAL_SLICE;
+        }
+    }
+
+    /* Scan probe, after a first round to get the sample into memory: */
+    max_threads = p->cpus > 0 && p->cpus < CAL_MAX_THREADS
+                  ? (unsigned)p->cpus : CAL_MAX_THREADS;
+    for (w = 1; w < max_threads; w *= 2)
+        cand[ncand++] = w;
+    cand[ncand++] = max_threads;
+    cal_run(cal_scan, max_threads);
+    best = 0;
+    for (i = 0; i < ncand; ++i) {
+        w = cand[i];
+        atomic_store(&cal.streams, 0);
+        atomic_store(&cal.stream_bytes, 0);
+        r = cal_run(cal_scan, w);
+        rate[w] = r > 0 ? total / r : 0;
+        LOG("Scan with %2u threads: %10.1f MiB/s\n", w, rate[w] / (1 << 20));
+        best = rate[w] > best ? rate[w] : best;
+    }
+    for (i = 0; rate[cand[i]] < CAL_GOOD * best; ++i)
+        ;
+    best_t = cand[i];
+    p->scan_rate = rate[best_t];
+
+    /* Write probe, with files the size of an average stream: */
+    p->write_method = method;
+    p->stripe_writers = cfg.stripe_writers;
+    if (cfg.index_file || cfg.stdout_frames || 0 == strcmp(cfg.odir, "-")) {
+        LOG("Not writing to a directory, skipping the write probe\n");
+        goto done;
+    }
+    cal.fsize = stat_get(&cal.streams)
+                ? stat_get(&cal.stream_bytes) / stat_get(&cal.streams) : 1 << 20;
+    cal.fsize = cal.fsize < 64 << 10 ? 64 << 10 : cal.fsize > 16 << 20 ? 16 << 20 : cal.fsize;
+    for (i = 1; i < nmap; ++i)
+        if (maplen[i] > maplen[0])
+            break;
+    i = i < nmap ? i : 0;
+    cal.src = map[i];
+    cal.srcfd = fds[i];
+    cal.srclen = maplen[i];
+    cal.fsize = cal.fsize < cal.srclen ? cal.fsize : cal.srclen;
+    cal.nfiles = CAL_WRITE_BYTES / cal.fsize < 8 ? 8 : CAL_WRITE_BYTES / cal.fsize;
+    snprintf(dir, sizeof dir, "%s/.riffx-calibrate.%ld", cfg.odir, (long)getpid());
+    if (0 != mkdirp(dir, 0755)) {
+        LOG("Failed to create %s: %s\n", dir, strerror(errno));
+        goto out;
+    }
+    cal.dir = dir;
+    best = 0;
+    for (int m = WRITE_COPY; m <= WRITE_PLAIN; ++m) {
+        double mbest = 0;
+        unsigned mw = 1;
+        for (w = 1; w <= CAL_MAX_WRITERS; w *= 2) {
+            rate[w] = cal_write_rate(m, w);
+            if (rate[w] < 0) {
+                LOG("Write probe failed: %s\n", strerror(atomic_load(&cal.err)));
+                rmdir(dir);
+                goto out;
+            }
+            LOG("Write (%s) with %u threads: %10.1f MiB/s\n",
+                m == WRITE_PLAIN ? "write" : "copy", w, rate[w] / (1 << 20));
+            mbest = rate[w] > mbest ? rate[w] : mbest;
+        }
+        for (mw = 1; rate[mw] < CAL_GOOD * mbest; mw *= 2)
+            ;
+        /* Kernel copies spare the page cache, writing has to be
+         * clearly faster: */
+        if (m == WRITE_COPY || rate[mw] * CAL_GOOD > best) {
+            best = rate[mw];
+            best_w = mw;
+            p->write_method = m;
+        }
+    }
+    rmdir(dir);
+    p->stripe_writers = best_w;
+    p->write_rate = best;
+done:
+    p->threads = best_t > best_w ? best_t : best_w;
+    LOG("Best: %u threads, %u writers per device, write method %s\n",
+        p->threads, p->stripe_writers, p->write_method == WRITE_PLAIN ? "write" : "copy");
+    err = 0;
+out:
+    cfg.write_method = method;
+    free(cal.slice);
+    free(cal.slice_len);
+    for (i = 0; i < nmap; ++i) {
+        munmap((void *)map[i], maplen[i]);
+        close(fds[i]);
+    }
+    return err;
+}
+
+/*
+ * Calibrate with --calibrate, and exit, or else load the profile and
+ * apply the settings not given on the command line, unless the profile
+ * is for another host.
+ */
+static void tune(const input_t *in, size_t nin) {
+    char buf[PATH_MAX];
+    const char *path = profile_path(buf, sizeof buf);
+    const char *odir = cfg.index_file || cfg.stdout_frames
+                       || 0 == strcmp(cfg.odir, "-") ? NULL : cfg.odir;
+    profile_t p, host;
+
+    host_fingerprint(&host, odir);
+    if (cfg.calibrate) {
+        if (0 != calibrate(in, nin, &host)
+            || (path && 0 != profile_save(path, &host)))
+            exit(EXIT_FAILURE);
+        if (path)
+            LOG("Saved tuning profile to %s\n", path);
+        exit(EXIT_SUCCESS);
+    }
+    if (!path || 0 != profile_load(path, &p))
+        return;
+    if (!same_host(&p, &host)) {
+        LOG("Ignoring %s, made for other hardware; run --calibrate\n", path);
+        return;
+    }
+    if (!(cfg_given & GIVEN_THREADS))
+        cfg.threads = p.threads;
+    if (!(cfg_given & GIVEN_STRIPE_WRITERS))
+        cfg.stripe_writers = p.stripe_writers;
+    if (!(cfg_given & GIVEN_WRITE_METHOD))
+        cfg.write_method = p.write_method;
+    if (cfg.verbose)
+        LOG("Tuning from %s: %u threads, %u writers per device, write method %s\n",
+            path, cfg.threads, cfg.stripe_writers,
+            cfg.write_method == WRITE_PLAIN ? "write" : "copy");
+}
+
+static int ixpkg_cmp(const void *a, const void *b) {
+    return strcmp((*(ixpkg_t * const *)a)->name, (*(ixpkg_t * const *)b)->name);
+}
+
+/*
+ * Write the packages collected in ix to the index file path, see
+ * riffidx.h for the layout.  The file is renamed into place, so an
+ * older index stays usable until the new one is complete.
+ * Returns 0 on success, -1 on error.
+ */
+static int index_write(const char *path) {
+    char tmp[PATH_MAX];
+    ixpkg_t **pkg = calloc(ix.n + 1, sizeof *pkg), *p;
+    riffidx_package_t *tab = calloc(ix.n + 1, sizeof *tab);
+    riffidx_header_t h;
+    uint64_t offs, str = 1, nstreams = 0;
+    uint64_t *lbase = calloc(ix.n + 1, sizeof *lbase);
+    FILE *fp = NULL;
+    size_t i, j;
+    int err = -1;
+
+    if (!pkg || !tab || !lbase) {
+        LOG("Out of memory\n");
+        goto out;
+    }
+    for (i = 0, p = ix.head; p; p = p->next)
+        pkg[i++] = p;
+    qsort(pkg, ix.n, sizeof *pkg, ixpkg_cmp);
+    /* Lay out the sections, strings start with an empty one: */
+    offs = sizeof h + ix.n * sizeof *tab;
+    for (i = 0; i < ix.n; ++i) {
+        p = pkg[i];
+        tab[i].name = str;
+        str += strlen(p->name) + 1;
+        lbase[i] = str;
+        str += p->lab_len;
+        tab[i].size = p->size;
+        tab[i].streams = offs;
+        tab[i].nstreams = p->n;
+        offs += p->n * sizeof(riffidx_stream_t);
+        tab[i].keys = offs;
+        tab[i].nkeys = p->n;
+        for (j = 0; j < p->n; ++j)
+            tab[i].nkeys += p->s[j].label != RIFFIDX_NONE;
+        offs += tab[i].nkeys * sizeof(riffidx_key_t);
+        tab[i].bloom = offs;
+        tab[i].bloom_bits = riffidx_bloom_bits(tab[i].nkeys);
+        offs += tab[i].bloom_bits / 8;
+        nstreams += p->n;
+    }
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, RIFFIDX_MAGIC, sizeof h.magic);
+    h.bom = RIFFIDX_BOM;
+    h.version = RIFFIDX_VERSION;
+    h.npackages = ix.n;
+    h.packages = sizeof h;
+    h.strings = offs;
+    h.strings_len = str;
+
+    snprintf(tmp, sizeof tmp, "%s.tmp", path);
+    if (!(fp = fopen(tmp, "w"))) {
+        LOG("Failed to create %s: %s\n", tmp, strerror(errno));
+        goto out;
+    }
+    fwrite(&h, sizeof h, 1, fp);
+    fwrite(tab, sizeof *tab, ix.n, fp);
+    for (i = 0; i < ix.n; ++i) {
+        riffidx_key_t *k = malloc((tab[i].nkeys + 1) * sizeof *k);
+        uint8_t *bloom = calloc(tab[i].bloom_bits / 8, 1);
+        size_t nk = 0;
+
+        p = pkg[i];
+        if (!k || !bloom || p->n > UINT32_MAX) {
+            LOG("Out of memory\n");
+            free(k);
+            free(bloom);
+            goto out;
+        }
+        for (j = 0; j < p->n; ++j) {
+            riffidx_stream_t s = p->s[j];
+            k[nk++] = (riffidx_key_t){ s.hash, j, RIFFIDX_HASH };
+            if (s.label != RIFFIDX_NONE) {
+                k[nk++] = (riffidx_key_t){
+                    riffidx_label_key(p->lab + s.label), j, RIFFIDX_LABEL };
+                s.label += lbase[i];
+            }
+            fwrite(&s, sizeof s, 1, fp);
+        }
+        qsort(k, nk, sizeof *k, riffidx_key_cmp);
+        for (j = 0; j < nk; ++j)
+            riffidx_bloom_add(bloom, tab[i].bloom_bits, k[j].key);
+        fwrite(k, sizeof *k, nk, fp);
+        fwrite(bloom, 1, tab[i].bloom_bits / 8, fp);
+        free(k);
+        free(bloom);
+    }
+    fputc('\0', fp);
+    for (i = 0; i < ix.n; ++i) {
+        fwrite(pkg[i]->name, 1, strlen(pkg[i]->name) + 1, fp);
+        if (pkg[i]->lab_len)
+            fwrite(pkg[i]->lab, 1, pkg[i]->lab_len, fp);
+    }
+    j = ferror(fp);
+    if (0 != fclose(fp))
+        j = 1;
+    fp = NULL;
+    if (j || 0 != rename(tmp, path)) {
+        LOG("Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        goto out;
+    }
+    LOG("Indexed %llu streams of %zu inputs in %s\n",
+        (unsigned long long)nstreams, ix.n, path);
+    err = 0;
+out:
+    if (fp) {
+        fclose(fp);
+        unlink(tmp);
+    }
+    while ((p = ix.head)) {
+        ix.head = p->next;
+        index_free(p);
+    }
+    ix.n = 0;
+    free(pkg);
+    free(tab);
+    free(lbase);
+    return err;
+}
+
+/*
+ * Look up the keys in the index file path, and print each stream found
+ * on a line of its own: package, offset, length, content hash and label,
+ * separated by tabs.  A key is either hash:HEX, a content hash, or
+ * label:TEXT, or else a file whose content hash is looked up, e.g. a
+ * stream dumped before.  The packages themselves are never touched.
+ * Returns 0 if all keys were found, -1 otherwise.
+ */
+static int query(const char *path, char *keys[], int nkeys) {
+    const riffidx_header_t *h;
+    struct stat st;
+    void *map;
+    int fd, err = 0;
+    double t0 = now_s();
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || 0 != fstat(fd, &st)) {
+        LOG("Failed to open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED || !(h = riffidx_open(map, st.st_size))) {
+        LOG("%s is not a valid index\n", path);
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return -1;
+    }
+    for (int i = 0; i < nkeys; ++i) {
+        const char *text = NULL;
+        uint32_t kind = RIFFIDX_HASH;
+        uint64_t key;
+        size_t found = 0;
+
+        if (0 == strncmp(keys[i], "label:", 6)) {
+            text = keys[i] + 6;
+            kind = RIFFIDX_LABEL;
+            key = riffidx_label_key(text);
+        }
+        else if (0 == strncmp(keys[i], "hash:", 5)) {
+            char *end;
+            errno = 0;
+            key = strtoull(keys[i] + 5, &end, 16);
+            if (errno || end == keys[i] + 5 || *end) {
+                LOG("Invalid hash '%s'\n", keys[i] + 5);
+                err = -1;
+                continue;
+            }
         }
         else {
-            n = snprintf(fpfx, sizeof fpfx, "%s/%s/", odir, tfn);
+            const void *m = NULL;
+            struct stat ks;
+
+            fd = open(keys[i], O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || 0 != fstat(fd, &ks) || (ks.st_size
+                && MAP_FAILED == (m = mmap(NULL, ks.st_size, PROT_READ,
+                                           MAP_PRIVATE, fd, 0)))) {
+                LOG("Failed to read %s: %s\n", keys[i], strerror(errno));
+                if (fd >= 0)
+                    close(fd);
+                err = -1;
+                continue;
+            }
+            key = riffidx_xxh64(m, ks.st_size, 0);
+            if (m)
+                munmap((void *)m, ks.st_size);
+            close(fd);
+        }
+        for (uint64_t n = 0; n < h->npackages; ++n) {
+            const riffidx_package_t *p = riffidx_package(h, n);
+            const riffidx_stream_t *s;
+            const riffidx_key_t *k;
+            size_t cnt = riffidx_find(h, p, key, kind, &k);
+
+            for (; cnt--; ++k) {
+                if (k->stream >= p->nstreams)
+                    continue;
+                s = (const riffidx_stream_t *)((const uint8_t *)map + p->streams)
+                    + k->stream;
+                /* Label keys are hashes, too: */
+                if (text && (s->label == RIFFIDX_NONE
+                    || 0 != strcmp(riffidx_string(h, s->label), text)))
+                    continue;
+                printf("%s\t%llu\t%llu\t%016llx\t%s\n",
+                       riffidx_string(h, p->name), (unsigned long long)s->offs,
+                       (unsigned long long)s->len, (unsigned long long)s->hash,
+                       s->label == RIFFIDX_NONE ? "" : riffidx_string(h, s->label));
+                ++found;
+            }
+        }
+        if (!found) {
+            LOG("%s: not found\n", keys[i]);
+            err = -1;
+        }
+    }
+    if (cfg.verbose)
+        LOG("Searched %llu packages in %.3f ms\n",
+            (unsigned long long)h->npackages, (now_s() - t0) * 1e3);
+    munmap(map, st.st_size);
+    return err;
+}
+
+int main(int argc, char *argv[]) {
+    int i, argidx = 1;
+    struct stat st;
+    input_t *in = NULL;
+    size_t n, nin = 0;
+
+    argidx = config(argc, argv);
+    if (argc - argidx < (cfg.watch_dir || cfg.job_file ? 0 : 1))
+        usage(argv[0]);
+    if (cfg.query_file)
+        exit(0 == query(cfg.query_file, argv + argidx, argc - argidx)
+             ? EXIT_SUCCESS : EXIT_FAILURE);
+    if (cfg.index_file && (cfg.watch_dir || cfg.stdout_frames || cfg.nstripe)) {
+        LOG("--index cannot be used with --watch, --stdout-frames or --stripe\n");
+        usage(argv[0]);
+    }
+    if (cfg.watch_dir && cfg.job_file) {
+        LOG("--watch and --jobs are mutually exclusive\n");
+        usage(argv[0]);
+    }
+    if ((cfg.watch_dir && argc - argidx > 1) || (cfg.job_file && argc > argidx)) {
+        LOG("No input files allowed with --watch or --jobs\n");
+        usage(argv[0]);
+    }
+    if (cfg.idle)
+        set_idle();
+    tb_init(&rd_bucket, cfg.max_read_rate);
+    tb_init(&wr_bucket, cfg.max_write_rate);
+    tb_init(&file_bucket, cfg.max_files_rate);
+
+    /* If the last argument does not designate an existing file, we
+     * attempt to interpret it as the name of the output directory,
+     * which an index does not need: */
+    if (argc > argidx && !cfg.index_file && (cfg.watch_dir
+        || 0 != stat(argv[argc - 1], &st) || S_ISDIR(st.st_mode))) {
+        cfg.odir = argv[--argc];
+        if (argc - argidx < 1 && !cfg.watch_dir)
+            usage(argv[0]);
+    }
+    if (cfg.entries_file && 0 != load_entries(cfg.entries_file))
+        exit(EXIT_FAILURE);
+    if (cfg.job_file) {
+        if (0 != load_jobs(cfg.job_file, &in, &nin))
+            exit(EXIT_FAILURE);
+    }
+    else if (!cfg.watch_dir) {
+        if (!(in = calloc(argc - argidx, sizeof *in))) {
+            LOG("Out of memory\n");
+            exit(EXIT_FAILURE);
         }
-        if ( (size_t)n >= sizeof fpfx ) {
-            LOG("output directory path truncated: '%s'\n", fpfx);
+        for (i = argidx; i < argc; i++) {
+            in[nin].opt = &cfg;
+            in[nin].path = argv[i];
+            in[nin].ord = i - argidx;
+            /* Sizes only matter for scheduling: */
+            in[nin++].size = cfg.threads && 0 == stat(argv[i], &st)
+                             ? (uint64_t)st.st_size : 0;
+        }
+    }
+    if (cfg.stdout_frames) {
+        /* Stream frames carry the would-be file names, but we never
+         * create any files or directories in this mode. */
+        if (isatty(STDOUT_FILENO)) {
+            LOG("Refusing to write stream frames to a terminal\n");
             exit(EXIT_FAILURE);
         }
-        if (!cfg.use_basename)
-            mkdirp(fpfx, 0755);
-        LOG("Dumping to %s...\n", fpfx);
-        cnt = extract(fd, fpfx);
-        close(fd);
-        LOG("%sDumped %d entries      \n", cfg.verbose?"":"\r", cnt);
-        total += cnt;
+        LOG("Writing stream frames to stdout\n");
+    }
+    /* Set up the output directories and load the names up front, so we
+     * do not fail halfway through: */
+    if (cfg.watch_dir && (0 != check_odir(cfg.odir)
+                || (cfg.names_file && !load_names(cfg.names_file))))
+        exit(EXIT_FAILURE);
+    for (n = 0; n < nin; ++n) {
+        if (n && in[n].opt == in[n - 1].opt)
+            continue;
+        if ((!cfg.index_file && 0 != check_odir(in[n].opt->odir))
+            || (in[n].opt->names_file && !load_names(in[n].opt->names_file)))
+            exit(EXIT_FAILURE);
+    }
+    tune(in, nin);
+    if (cfg.nstripe) {
+        if (cfg.stdout_frames || 0 == strcmp(cfg.odir, "-")) {
+            LOG("--stripe needs an output directory\n");
+            exit(EXIT_FAILURE);
+        }
+        if (0 != stripe_start())
+            exit(EXIT_FAILURE);
+    }
+
+    if (cfg.manifest) {
+        manifest_fp = fopen(cfg.manifest, "w");
+        if (!manifest_fp) {
+            LOG("Failed to create %s: %s\n", cfg.manifest, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        if (cfg.watch_dir)
+            setvbuf(manifest_fp, NULL, _IOLBF, 0);
+    }
+    if (cfg.threads)
+        pool_start();
+    reporter_start();
+
+    if (cfg.watch_dir) {
+        watch();
+    }
+    else {
+        if (cfg.shard_n) {
+            const char **paths = malloc(nin * sizeof *paths + 1);
+            char *sel = malloc(nin + 1);
+            size_t k;
+
+            if (!paths || !sel) {
+                LOG("Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            for (n = 0; n < nin; ++n)
+                paths[n] = in[n].path;
+            if (0 != select_shard(paths, nin, sel))
+                exit(EXIT_FAILURE);
+            LOG("Processing shard %u of %u\n", cfg.shard_k, cfg.shard_n);
+            for (k = n = 0; n < nin; ++n)
+                if (sel[n])
+                    in[k++] = in[n];
+            nin = k;
+            free(paths);
+            free(sel);
+        }
+        /* With a pool, start with the largest inputs so that the small
+         * ones fill the gaps at the end: */
+        if (cfg.threads)
+            qsort(in, nin, sizeof *in, input_cmp);
+        for (n = 0; n < nin; ++n)
+            pool_submit(in[n].opt, in[n].path, 0, in[n].ord);
+    }
+    pool_finish();
+    stripe_finish();
+    reporter_stop();
+    free(in);
+    if (cfg.index_file) {
+        if (0 != index_write(cfg.index_file))
+            exit(EXIT_FAILURE);
+        exit(EXIT_SUCCESS);
+    }
+    LOG("%sDumped a total of %ld entries.\n", sol, total);
+    if (cfg.silent)
+        LOG("%llu of them silent%s.\n", (unsigned long long)stat_get(&stats.streams_silent),
+            cfg.silent == SILENT_SKIP ? ", skipped" : "");
+    if (manifest_fp && 0 != fclose(manifest_fp)) {
+        LOG("Failed to write %s: %s\n", cfg.manifest, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if (cfg.entries_file && 0 != (n = entries_missing())) {
+        LOG("%zu of %zu entries not found.\n", n, nentries);
+        exit(EXIT_FAILURE);
+    }
+    if (0 != stat_get(&stats.errors)) {
+        LOG("%llu inputs or streams failed.\n",
+            (unsigned long long)stat_get(&stats.errors));
+        exit(EXIT_FAILURE);
     }
-    LOG("\rDumped a total of %d entries.\n", total);
 
     exit(EXIT_SUCCESS);
 }
@@ -0,0 +1,227 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ */
+
+/*
+ * Read the stream frames written by 'riffx --stdout-frames' from a file
+ * or stdin and list them, or extract the payloads into the current
+ * working directory.  Extracted files keep the path of their frame name,
+ * e.g. output/foo/000001.riff, with leading slashes removed like tar
+ * does, so /tmp/out/000001.riff becomes tmp/out/000001.riff; frames with
+ * names containing ".." are not extracted, and neither are frames whose
+ * name was already extracted in the same run.
+ *
+ * Frame header layout, all fields in little endian byte order:
+ *
+ *   0  4  magic "RXF1"
+ *   4  4  header length, including the name
+ *   8  8  payload length
+ *  16  8  offset of the stream in its input file
+ *  24  1  byte order: 0 = RIFF (little endian), 1 = RIFX (big endian)
+ *  25  1  reserved
+ *  26  2  name length
+ *  28  -  name, not null-terminated
+ *
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+#define FRAME_HDR_SIZE  28
+
+#define LOG(...)    (fprintf(stderr,__VA_ARGS__))
+#define DIE(...)    do{LOG(__VA_ARGS__);exit(EXIT_FAILURE);}while(0)
+
+static uint64_t get_le(const uint8_t *b, int n) {
+    uint64_t v = 0;
+    while (n--)
+        v = v << 8 | b[n];
+    return v;
+}
+
+/* Copy len bytes from ifp to ofp, or skip them if ofp is NULL. */
+static int copy(FILE *ifp, FILE *ofp, uint64_t len) {
+    char buf[65536];
+    size_t n;
+
+    while (len > 0) {
+        n = len < sizeof buf ? (size_t)len : sizeof buf;
+        if (n != fread(buf, 1, n, ifp))
+            return -1;
+        if (ofp && n != fwrite(buf, 1, n, ofp))
+            return -1;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Tell whether name is relative and stays below the current directory. */
+static int safe_name(const char *name) {
+    const char *p = name;
+
+    if (!*name || *name == '/')
+        return 0;
+    for (;;) {
+        size_t n = strcspn(p, "/");
+        if (n == 2 && p[0] == '.' && p[1] == '.')
+            return 0;
+        if (!p[n])
+            return n > 0;
+        p += n + 1;
+    }
+}
+
+/* Create the missing parent directories of name, like mkdir -p. */
+static int make_parents(char *name) {
+    char *p;
+
+    for (p = strchr(name, '/'); p; p = strchr(p + 1, '/')) {
+        *p = '\0';
+        if (0 != mkdir(name, 0755) && errno != EEXIST) {
+            *p = '/';
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+/*
+ * Names extracted so far, in an open addressing hash table, so that
+ * frames with the same name do not silently overwrite each other.
+ */
+static char **seen;
+static size_t seen_cap, seen_cnt;
+
+static uint32_t hash(const char *s) {
+    uint32_t h = 2166136261u;
+    while (*s)
+        h = (h ^ (uint8_t)*s++) * 16777619u;
+    return h;
+}
+
+static char **seen_slot(char **tab, size_t cap, const char *name) {
+    size_t i = hash(name) & (cap - 1);
+    while (tab[i] && strcmp(tab[i], name))
+        i = (i + 1) & (cap - 1);
+    return &tab[i];
+}
+
+/* Remember name.  Returns 1 if it was seen before, 0 if not. */
+static int seen_add(const char *name) {
+    char **slot;
+
+    if (2 * (seen_cnt + 1) > seen_cap) {
+        size_t cap = seen_cap ? 2 * seen_cap : 1024, i;
+        char **tab = calloc(cap, sizeof *tab);
+        if (!tab)
+            DIE("Out of memory\n");
+        for (i = 0; i < seen_cap; ++i)
+            if (seen[i])
+                *seen_slot(tab, cap, seen[i]) = seen[i];
+        free(seen);
+        seen = tab;
+        seen_cap = cap;
+    }
+    slot = seen_slot(seen, seen_cap, name);
+    if (*slot)
+        return 1;
+    if (!(*slot = strdup(name)))
+        DIE("Out of memory\n");
+    ++seen_cnt;
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *ifp = stdin;
+    int extract = 0;
+    const char *iname = "stdin";
+    uint8_t hdr[FRAME_HDR_SIZE];
+    char name[UINT16_MAX + 1];
+    size_t cnt = 0;
+    int status = EXIT_SUCCESS, stripped = 0;
+
+    if (argc > 1 && 0 == strcmp(argv[1], "-x")) {
+        extract = 1;
+        --argc;
+        ++argv;
+    }
+    if (argc > 2)
+        DIE("Usage: unframe [-x] [framefile]\n");
+    if (argc > 1) {
+        iname = argv[1];
+        ifp = fopen(iname, "rb");
+        if (!ifp)
+            DIE("fopen %s: %s\n", iname, strerror(errno));
+    }
+
+    for (;;) {
+        uint64_t hlen, plen, offs;
+        size_t nlen, n;
+        int bo;
+        FILE *ofp = NULL;
+        char *path = name;
+
+        n = fread(hdr, 1, sizeof hdr, ifp);
+        if (n == 0)
+            break;
+        if (n != sizeof hdr)
+            DIE("%s: truncated frame header\n", iname);
+        if (memcmp(hdr, "RXF1", 4))
+            DIE("%s: bad frame magic after %zu frames\n", iname, cnt);
+        hlen = get_le(hdr + 4, 4);
+        plen = get_le(hdr + 8, 8);
+        offs = get_le(hdr + 16, 8);
+        bo = hdr[24];
+        nlen = get_le(hdr + 26, 2);
+        if (hlen != FRAME_HDR_SIZE + nlen)
+            DIE("%s: inconsistent frame header length\n", iname);
+        if (nlen != fread(name, 1, nlen, ifp))
+            DIE("%s: truncated frame header\n", iname);
+        name[nlen] = '\0';
+        printf("%12llu %12llu %s %s\n", (unsigned long long)offs,
+                (unsigned long long)plen, bo ? "RIFX" : "RIFF", name);
+        if (extract) {
+            if (*path == '/') {
+                if (!stripped) {
+                    LOG("%s: removing leading '/' from frame names\n", iname);
+                    stripped = 1;
+                }
+                while (*path == '/')
+                    ++path;
+            }
+            if (!safe_name(path)) {
+                LOG("%s: not extracting unsafe name '%s'\n", iname, name);
+                status = EXIT_FAILURE;
+            }
+            else if (seen_add(path)) {
+                LOG("%s: not overwriting '%s', extracted before\n", iname, path);
+                status = EXIT_FAILURE;
+            }
+            else if (0 != make_parents(path) || !(ofp = fopen(path, "wb")))
+                DIE("fopen %s: %s\n", path, strerror(errno));
+        }
+        if (0 != copy(ifp, ofp, plen))
+            DIE("%s: truncated or unwritable payload '%s'\n", iname, name);
+        if (ofp && 0 != fclose(ofp))
+            DIE("fclose %s: %s\n", path, strerror(errno));
+        ++cnt;
+    }
+    if (ferror(ifp))
+        DIE("read %s: %s\n", iname, strerror(errno));
+    if (ifp != stdin)
+        fclose(ifp);
+    exit(status);
+}
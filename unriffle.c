@@ -12,62 +12,69 @@
  * is given a special treatment to make them more readable to mere humans.
  * This may help to get an idea about the kind of data contained.
  *
+ * RF64 and BW64 files, the 64 bit variants of RIFF, are understood as
+ * well: chunks too large for their 32 bit size field carry a size of
+ * 0xFFFFFFFF, the actual size is looked up in the ds64 chunk.
+ *
+ * With --analyze the samples in the data chunk of a PCM file are not
+ * dumped, but summarized per channel instead: peak and RMS level, DC
+ * offset, the number of clipped samples and the share of silence.
+ *
  */
 
 #include <ctype.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "riffchunk.h"
+
 
 static struct {
     FILE *dump_fp;
     FILE *log_fp;
     int endianess;
+    int analyze;                /* summarize PCM data, don't dump it */
+    const uint8_t *fmt;         /* last fmt chunk seen, and its size */
+    uint64_t fmt_size;
+    const void *basep;          /* the file buffer, and its size */
+    size_t fsize;
 } cfg = {
     NULL,
     NULL,
     0,
+    0,
+    NULL,
+    0,
+    NULL,
+    0,
 };
 
-typedef uint8_t fcc_t[4];
-
 #define FOURCC_IS(p_,q_) (!memcmp((const void *)(p_),(const void *)(q_),4))
 
-typedef
-    struct RIFF_chunk_t {
-        fcc_t fcc;
-        uint32_t csize;
-        uint8_t data[];
-    }
-    RIFF_chunk_t;
-
 
-/* Little/Big Endian to native uint32 conversion: */
+/* Little/Big Endian to native conversion: */
 static inline uint32_t get_ui32(const void *p) {
-    const uint8_t *b = p;
-    if (!cfg.endianess)     /* Little Endian byte order (RIFF) */
-        return b[0] | b[1] << 8 | b[2] << 16 | b[3] << 24;
-    /* Big Endian byte order (RIFX) */
-    return b[3] | b[2] << 8 | b[1] << 16 | b[0] << 24;
+    return riffchunk_u32(p, cfg.endianess);
 }
 
-/* Little/Big Endian to native uint16 conversion: */
 static inline uint16_t get_ui16(const void *p) {
-    const uint8_t *b = p;
-    if (!cfg.endianess)     /* Little Endian byte order (RIFF) */
-        return b[0] | b[1] << 8;
-    /* Big Endian byte order (RIFX) */
-    return b[1] | b[0] << 8;
+    return riffchunk_u16(p, cfg.endianess);
 }
 
 static inline uint8_t get_ui8(const void *p) {
     return *(const uint8_t *)p;
 }
 
+/* 64 bit values only occur in little endian RF64/BW64 files: */
+static inline uint64_t get_ui64(const void *p) {
+    return riffchunk_u64(p, cfg.endianess);
+}
+
 /*
  * dump helper:
  */
@@ -111,22 +118,30 @@ static inline void xdump(const void *s, size_t n, const void *basep) {
     }
 }
 
-static inline void dump4cc(const char *s, fcc_t fcc, const void *basep) {
-    fcc_t f;
+static inline void dump4cc(const char *s, const uint8_t *fcc, const void *basep) {
+    uint8_t f[4];
     for (size_t i = 0; i < sizeof f; i++)
         f[i] = isprint((unsigned char)fcc[i]) ? fcc[i] : '?';
     DMPO(fcc, basep);
     DMP("%14s: '%4.4s'\n", s, f);
 }
 
-static inline void dump4ccEnd(const void *p, fcc_t fcc, const void *basep) {
-    fcc_t f;
+static inline void dump4ccEnd(const void *p, const uint8_t *fcc, const void *basep) {
+    uint8_t f[4];
     for (size_t i = 0; i < sizeof f; i++)
         f[i] = isprint((unsigned char)fcc[i]) ? fcc[i] : '?';
     DMPO(p, basep);
     DMP("   ['%4.4s' end]\n", f);
 }
 
+static inline void dump4ccTrunc(const void *p, const uint8_t *fcc, const void *basep) {
+    uint8_t f[4];
+    for (size_t i = 0; i < sizeof f; i++)
+        f[i] = isprint((unsigned char)fcc[i]) ? fcc[i] : '?';
+    DMPO(p, basep);
+    DMP("   ['%4.4s' truncated]\n", f);
+}
+
 static inline void dumpU8(const char *s, const void *u, const void *basep) {
     DMPO(u, basep);
     DMP("%14s: %"PRIu8"\n", s, get_ui8(u));
@@ -142,96 +157,341 @@ static inline void dumpU32(const char *s, const void *u, const void *basep) {
     DMP("%14s: %"PRIu32"\n", s, get_ui32(u));
 }
 
-static inline void dumpStr(const char *s, const void *u, const void *basep) {
+static inline void dumpU64(const char *s, const void *u, const void *basep) {
+    DMPO(u, basep);
+    DMP("%14s: %"PRIu64"\n", s, get_ui64(u));
+}
+
+static inline void dumpStr(const char *s, const void *u, size_t n, const void *basep) {
+    const char *e = memchr(u, '\0', n);
+    DMPO(u, basep);
+    DMP("%14s: %.*s\n", s, (int)(e ? (size_t)(e - (const char *)u) : n), (const char *)u);
+}
+
+/*
+ * PCM analysis:
+ *
+ * The kernels below accumulate the statistics of interleaved samples
+ * in lanes, lane j receiving samples j, j + w, j + 2w, ... for a lane
+ * count w that is a multiple of the channel count.  That way every lane
+ * holds samples of a single channel, and the loop over the lanes, with
+ * no dependency between them, is turned into SIMD code by the compiler.
+ * Samples are converted to float in full scale units and summed in
+ * single precision for up to PCM_ROWS rows of w samples, before the
+ * lanes are added to the double precision totals.  Lanes are folded
+ * into channels at the end.
+ */
+#define PCM_VEC         16
+#define PCM_MAX_CH      64
+#define PCM_LANES       (PCM_VEC * PCM_MAX_CH)
+#define PCM_ROWS        256
+/* Samples below -60 dBFS count as silence: */
+#define PCM_SILENCE     0.001f
+
+typedef struct {
+    uint64_t n;                 /* samples */
+    double lo, hi;              /* extremes, in full scale units */
+    double sum, sumsq;
+    uint64_t clipped, silent;
+} pcm_stats_t;
+
+static inline float ld_s16le(const uint8_t *b) {
+    return (int16_t)(uint16_t)(b[0] | b[1] << 8);
+}
+
+static inline float ld_s16be(const uint8_t *b) {
+    return (int16_t)(uint16_t)(b[1] | b[0] << 8);
+}
+
+static inline float ld_s24le(const uint8_t *b) {
+    return (int32_t)((uint32_t)b[0] << 8 | (uint32_t)b[1] << 16
+                     | (uint32_t)b[2] << 24) >> 8;
+}
+
+static inline float ld_s24be(const uint8_t *b) {
+    return (int32_t)((uint32_t)b[2] << 8 | (uint32_t)b[1] << 16
+                     | (uint32_t)b[0] << 24) >> 8;
+}
+
+static inline float ld_f32le(const uint8_t *b) {
+    uint32_t u = b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+    float f;
+    memcpy(&f, &u, sizeof f);
+    return f;
+}
+
+static inline float ld_f32be(const uint8_t *b) {
+    uint32_t u = b[3] | b[2] << 8 | b[1] << 16 | (uint32_t)b[0] << 24;
+    float f;
+    memcpy(&f, &u, sizeof f);
+    return f;
+}
+
+/*
+ * Analyze n samples of bps_ bytes each, read by ld_ and multiplied by
+ * scale_ to get full scale units, into w lane statistics st.  Samples
+ * at or beyond +/-clip_ count as clipped.
+ */
+#define PCM_KERNEL(name_, ld_, bps_, scale_, clip_)                         \
+static void name_(const uint8_t *p, size_t n, size_t w, pcm_stats_t *st) {  \
+    float lo[PCM_LANES], hi[PCM_LANES], sum[PCM_LANES], sq[PCM_LANES];      \
+    int32_t clip[PCM_LANES], sil[PCM_LANES];                                \
+    size_t rows, j;                                                         \
+                                                                            \
+    for (j = 0; j < w; ++j)                                                 \
+        memset(&st[j], 0, sizeof st[j]);                                    \
+    while (n >= w) {                                                        \
+        rows = n / w > PCM_ROWS ? PCM_ROWS : n / w;                         \
+        for (j = 0; j < w; ++j) {                                           \
+            lo[j] = hi[j] = sum[j] = sq[j] = 0;                             \
+            clip[j] = sil[j] = 0;                                           \
+        }                                                                   \
+        for (; rows; --rows, p += w * (bps_), n -= w)                       \
+            for (j = 0; j < w; ++j) {                                       \
+                float x = ld_(p + j * (bps_)) * (scale_);                   \
+                lo[j] = x < lo[j] ? x : lo[j];                              \
+                hi[j] = x > hi[j] ? x : hi[j];                              \
+                sum[j] += x;                                                \
+                sq[j] += x * x;                                             \
+                clip[j] += fabsf(x) >= (clip_);                             \
+                sil[j] += fabsf(x) < PCM_SILENCE;                           \
+            }                                                               \
+        for (j = 0; j < w; ++j) {                                           \
+            st[j].lo = lo[j] < st[j].lo ? lo[j] : st[j].lo;                 \
+            st[j].hi = hi[j] > st[j].hi ? hi[j] : st[j].hi;                 \
+            st[j].sum += sum[j];                                            \
+            st[j].sumsq += sq[j];                                           \
+            st[j].clipped += clip[j];                                       \
+            st[j].silent += sil[j];                                         \
+        }                                                                   \
+    }                                                                       \
+    /* A last partial row: */                                               \
+    for (j = 0; j < n; ++j) {                                               \
+        float x = ld_(p + j * (bps_)) * (scale_);                           \
+        st[j].lo = x < st[j].lo ? x : st[j].lo;                             \
+        st[j].hi = x > st[j].hi ? x : st[j].hi;                             \
+        st[j].sum += x;                                                     \
+        st[j].sumsq += (double)x * x;                                       \
+        st[j].clipped += fabsf(x) >= (clip_);                               \
+        st[j].silent += fabsf(x) < PCM_SILENCE;                             \
+    }                                                                       \
+}
+
+PCM_KERNEL(pcm_s16le, ld_s16le, 2, 1.0f / 32768, 32767.0f / 32768)
+PCM_KERNEL(pcm_s16be, ld_s16be, 2, 1.0f / 32768, 32767.0f / 32768)
+PCM_KERNEL(pcm_s24le, ld_s24le, 3, 1.0f / 8388608, 8388607.0f / 8388608)
+PCM_KERNEL(pcm_s24be, ld_s24be, 3, 1.0f / 8388608, 8388607.0f / 8388608)
+PCM_KERNEL(pcm_f32le, ld_f32le, 4, 1.0f, 1.0f)
+PCM_KERNEL(pcm_f32be, ld_f32be, 4, 1.0f, 1.0f)
+
+static inline void dumpDB(const char *s, double v, const void *u, const void *basep) {
     DMPO(u, basep);
-    DMP("%14s: %s\n", s, (const char *)u);
+    if (v > 0)
+        DMP("%14s: %.2f dBFS\n", s, 20 * log10(v));
+    else
+        DMP("%14s: -inf dBFS\n", s);
 }
 
-static int rdump(void *p, size_t fsize, const void *basep) {
-    RIFF_chunk_t *r = p;
-    uint32_t sz;
+/*
+ * Summarize the sz bytes of PCM samples at p, as described by the last
+ * fmt chunk seen, or return -1 if they are in a format we don't know.
+ */
+static int analyze(const uint8_t *p, uint64_t sz, const void *basep) {
+    static pcm_stats_t lane[PCM_LANES];
+    void (*kernel)(const uint8_t *, size_t, size_t, pcm_stats_t *);
+    const uint8_t *f = cfg.fmt;
+    unsigned tag, nch, align, bps;
+    size_t n, w;
 
-    if (fsize < 8)
-        return 0;
-    sz = get_ui32(&r->csize);
-    if (sz < 2)
-        return 0;
-    if (sz > fsize)
+    if (!f || cfg.fmt_size < 16)
         return -1;
-    DMP("\n");
-    dump4cc("Chunk ID", r->fcc, basep);
-    dumpU32("Size", &r->csize, basep);
-
-    if (FOURCC_IS(&r->fcc, "RIFF") || FOURCC_IS(&r->fcc, "RIFX")) {
-        dump4cc("RIFF Type", r->data, basep);
-        rdump(r->data + sizeof(fcc_t), sz, basep);
-        dump4ccEnd(r->data + sz, r->fcc, basep);
-        if (fsize > sz + 8 ) {
-            DMP("\nExtra Bytes at end of file:\n");
-            xdump(r->data + sz, fsize - (sz + 8), basep);
+    tag = get_ui16(f);
+    nch = get_ui16(f + 2);
+    align = get_ui16(f + 12);
+    /* WAVE_FORMAT_EXTENSIBLE: the real format is in the sub format GUID */
+    if (tag == 0xFFFE && cfg.fmt_size >= 26)
+        tag = get_ui16(f + 24);
+    if (nch < 1 || nch > PCM_MAX_CH || align % nch)
+        return -1;
+    bps = align / nch;
+    if (tag == 1 && bps == 2)
+        kernel = cfg.endianess ? pcm_s16be : pcm_s16le;
+    else if (tag == 1 && bps == 3)
+        kernel = cfg.endianess ? pcm_s24be : pcm_s24le;
+    else if (tag == 3 && bps == 4)
+        kernel = cfg.endianess ? pcm_f32be : pcm_f32le;
+    else
+        return -1;
+
+    n = sz / align * nch;
+    w = (size_t)nch * PCM_VEC;
+    kernel(p, n, w, lane);
+    /* Fold the lanes into channels: */
+    for (size_t c = 0; c < nch; ++c) {
+        pcm_stats_t *s = &lane[c];
+        double peak, mean;
+        s->n = n / w * PCM_VEC + (c < n % w ? (n % w - c + nch - 1) / nch : 0);
+        for (size_t j = c + nch; j < w; j += nch) {
+            s->lo = lane[j].lo < s->lo ? lane[j].lo : s->lo;
+            s->hi = lane[j].hi > s->hi ? lane[j].hi : s->hi;
+            s->sum += lane[j].sum;
+            s->sumsq += lane[j].sumsq;
+            s->clipped += lane[j].clipped;
+            s->silent += lane[j].silent;
         }
-        return 0;
+        peak = -s->lo > s->hi ? -s->lo : s->hi;
+        mean = s->n ? s->sum / s->n : 0;
+        DMPO(p, basep);
+        DMP("%14s: %zu\n", "Channel", c);
+        dumpDB("Peak", peak, p, basep);
+        dumpDB("RMS", s->n ? sqrt(s->sumsq / s->n) : 0, p, basep);
+        DMPO(p, basep);
+        DMP("%14s: %+.6f\n", "DC Offset", mean);
+        DMPO(p, basep);
+        DMP("%14s: %"PRIu64"\n", "Clipped", s->clipped);
+        DMPO(p, basep);
+        DMP("%14s: %.2f%%\n", "Silence", s->n ? 100.0 * s->silent / s->n : 0);
+    }
+    return 0;
+}
+
+/*
+ * Chunk visitor callbacks, see riffchunk.h:
+ */
+static void dump_head(const riffchunk_t *c) {
+    const void *basep = cfg.basep;
+
+    DMP("\n");
+    dump4cc("Chunk ID", c->fcc, basep);
+    dumpU32("Size", c->fcc + 4, basep);
+    if (c->size != c->size32) {
+        DMPO(c->fcc + 4, basep);
+        DMP("%14s: %"PRIu64"\n", "Size (ds64)", c->size);
+    }
+}
+
+static void dump_tail(const riffchunk_t *c) {
+    const void *basep = cfg.basep;
+
+    if (c->len < c->size) {
+        dump4ccTrunc(c->data + c->len, c->fcc, basep);
+        return;
     }
-    else if (FOURCC_IS(&r->fcc, "LIST")) {
-        dump4cc("Form Type", r->data, basep);
-        rdump(r->data + sizeof(fcc_t), sz - sizeof(fcc_t), basep);
+    dump4ccEnd(c->data + c->len, c->fcc, basep);
+    /* Take care of chunk padding: */
+    if (c->depth && c->len % 2 && c->offs + 8 + c->len < cfg.fsize)
+        dumpU8("Padding Byte", c->data + c->len, basep);
+}
+
+static int enter(void *arg, const riffchunk_t *c) {
+    (void)arg;
+    if (c->size < 2)
+        return RIFFCHUNK_SKIP;
+    dump_head(c);
+    dump4cc(c->depth ? "Form Type" : "RIFF Type", c->data, cfg.basep);
+    return RIFFCHUNK_NEXT;
+}
+
+static int leave(void *arg, const riffchunk_t *c) {
+    (void)arg;
+    if (c->size >= 2)
+        dump_tail(c);
+    return RIFFCHUNK_NEXT;
+}
+
+static int leaf(void *arg, const riffchunk_t *c) {
+    const void *basep = cfg.basep;
+    const uint8_t *d = c->data;
+    size_t sz = c->len;
+
+    (void)arg;
+    if (c->size < 2)
+        return RIFFCHUNK_SKIP;
+    dump_head(c);
+    if ((FOURCC_IS(c->fcc, "labl") || FOURCC_IS(c->fcc, "note")) && sz >= 4) {
+        dumpU32("Cue Point ID", d, basep);
+        dumpStr("Label Text", d + 4, sz - 4, basep);
     }
-    else if (FOURCC_IS(&r->fcc, "labl") || FOURCC_IS(&r->fcc, "note")) {
-        dumpU32("Cue Point ID", r->data, basep);
-        dumpStr("Label Text", r->data + 4, basep);
-        fsize -= 8;
+    else if (FOURCC_IS(c->fcc, "cue ") && sz >= 4) {
+        uint32_t cn = get_ui32(d);
+        dumpU32("# Cue points", d, basep);
+        for (uint32_t i = 0; i < cn && 4 + (i + 1) * 24 <= sz; ++i) {
+            const uint8_t *p = d + i * 24 + 4;
+            dumpU32("Cue Point ID", p, basep);
+            dumpU32("Cue Position", p + 4, basep);
+            dump4cc("Data Chunk ID", p + 8, basep);
+            dumpU32("Chunk Start", p + 12, basep);
+            dumpU32("Block Start", p + 16, basep);
+            dumpU32("Sample Offset", p + 20, basep);
+        }
     }
-    else if (FOURCC_IS(&r->fcc, "cue ")) {
-        uint32_t cn = get_ui32(r->data);
-        dumpU32("# Cue points", &r->data, basep);
-        for (uint32_t i = 0; i < cn; ++i) {
-            uint8_t *c;
-            c = r->data + i * 24 + 4;
-            dumpU32("Cue Point ID", c, basep);
-            dumpU32("Cue Position", c+4, basep);
-            dump4cc("Data Chunk ID", c + 8, basep);
-            dumpU32("Chunk Start", c+12, basep);
-            dumpU32("Block Start", c+16, basep);
-            dumpU32("Sample Offset", c+20, basep);
+    else if (FOURCC_IS(c->fcc, "ds64") && sz >= 24) {
+        uint32_t tn = sz >= 28 ? get_ui32(d + 24) : 0;
+        dumpU64("RIFF Size", d, basep);
+        dumpU64("Data Size", d + 8, basep);
+        dumpU64("Sample Count", d + 16, basep);
+        if (sz >= 28)
+            dumpU32("Table Length", d + 24, basep);
+        for (uint32_t i = 0; i < tn && 28 + (i + 1) * 12 <= sz; ++i) {
+            dump4cc("Chunk ID", d + 28 + i * 12, basep);
+            dumpU64("Chunk Size", d + 32 + i * 12, basep);
         }
     }
-    else if (FOURCC_IS(&r->fcc, "fmt ")) {
-        dumpU16("Compression", r->data, basep);
-        dumpU16("Channels", r->data+2, basep);
-        dumpU32("Sample Rate", r->data+4, basep);
-        dumpU32("Avg. Bytes/s", r->data+8, basep);
-        dumpU16("Block align", r->data+12, basep);
-        dumpU16("Signif. bit/s", r->data+14, basep);
-        if (sz > 16) {
-            dumpU16("Xtra FMT bytes", r->data+16, basep);
-            xdump(r->data+18, sz-18, basep);
+    else if (FOURCC_IS(c->fcc, "fmt ") && sz >= 16) {
+        cfg.fmt = d;
+        cfg.fmt_size = sz;
+        dumpU16("Compression", d, basep);
+        dumpU16("Channels", d + 2, basep);
+        dumpU32("Sample Rate", d + 4, basep);
+        dumpU32("Avg. Bytes/s", d + 8, basep);
+        dumpU16("Block align", d + 12, basep);
+        dumpU16("Signif. bit/s", d + 14, basep);
+        if (sz >= 18) {
+            dumpU16("Xtra FMT bytes", d + 16, basep);
+            xdump(d + 18, sz - 18, basep);
         }
     }
-    else if (sz <= fsize) {
-        xdump(r->data, sz, basep);
+    else if (FOURCC_IS(c->fcc, "data") && cfg.analyze) {
+        if (0 != analyze(d, sz, basep)) {
+            DMPO(d, basep);
+            DMP("%14s: not analyzed, unsupported sample format\n", "PCM Data");
+        }
     }
-    dump4ccEnd(r->data + sz, r->fcc, basep);
-    /* Take care of chunk padding: */
-    if (sz % 2) {
-        dumpU8("Padding Byte", r->data + sz, basep);
-        ++sz;
+    else {
+        xdump(d, sz, basep);
     }
-    return rdump(r->data + sz, fsize - sz, basep);
+    dump_tail(c);
+    return RIFFCHUNK_NEXT;
+}
+
+static int enter_form(void *arg, const riffchunk_t *c) {
+    if (c->depth == 0)
+        *(size_t *)arg = 8 + c->len;
+    return enter(NULL, c);
 }
 
 int main(int argc, char *argv[]) {
     FILE *ifp = stdin;
     size_t filesize = 0;
     void *fbuf;
-    RIFF_chunk_t *r;
-    size_t nrd;
+    size_t nrd, form_size = 0;
+    riffchunk_visitor_t v = { enter_form, leave, leaf, &form_size };
+    const char *fname = NULL;
 
     cfg.dump_fp = stdout;
     cfg.log_fp = stderr;
-    if (argc > 1) {
-        ifp = fopen(argv[1], "r");
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--analyze"))
+            cfg.analyze = 1;
+        else if (!fname)
+            fname = argv[i];
+        else
+            DIE("Usage: %s [--analyze] [file]\n", argv[0]);
+    }
+    if (fname) {
+        ifp = fopen(fname, "r");
         if (!ifp)
-            DIE("fopen %s: %s\n", argv[1], strerror(errno));
+            DIE("fopen %s: %s\n", fname, strerror(errno));
         fseek(ifp, 0, SEEK_END);
         filesize = ftell(ifp);
         rewind(ifp);
@@ -242,18 +502,20 @@ int main(int argc, char *argv[]) {
     nrd = fread(fbuf, 1, filesize, ifp);
     if (ferror(ifp) || nrd != filesize)
         DIE("read: %s\n", strerror(errno));
-    r = fbuf;
+    cfg.basep = fbuf;
+    cfg.fsize = filesize;
+    cfg.endianess = riffchunk_form(fbuf, filesize);
+    if (cfg.endianess < 0)
+        DIE("%s is not a RIFF file!\n", fname);
 
-    if (!FOURCC_IS(r->fcc, "RIFF")) {
-        if (!FOURCC_IS(r->fcc, "RIFX"))
-            DIE("%s is not a RIFF file!\n", argv[1]);
-        cfg.endianess = 1;
-    }
-
-    DMP("File name: %s\n", argv[1]);
+    DMP("File name: %s\n", fname ? fname : "-");
     DMP("File size: %zu\n", filesize);
     DMP("\nBYTE OFFSET         FIELD  VALUE\n");
-    rdump(r, filesize, fbuf);
+    riffchunk_walk(fbuf, filesize, &v);
+    if (filesize > form_size) {
+        DMP("\nExtra Bytes at end of file:\n");
+        xdump((uint8_t *)fbuf + form_size, filesize - form_size, fbuf);
+    }
     free(fbuf);
     exit(EXIT_SUCCESS);
 }
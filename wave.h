@@ -0,0 +1,438 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ *
+ * WAVE stream helpers for riffx.
+ *
+ *  - wave_parse() locates the fmt and data chunks of a RIFF/RIFX/RF64
+ *    WAVE stream in memory, using the chunk walker from riffchunk.h,
+ *    and decodes the few fmt fields we need.
+ *
+ *  - wave_silent() tells whether the audio in the data chunk stays
+ *    below a given level, for PCM (8, 16, 24 bit integer and 32 bit
+ *    float samples) and IMA ADPCM (Wwise 0x0002, MS IMA 0x0011).
+ *
+ *  - wave_header() builds a canonical 44 byte RIFF/WAVE header, just
+ *    fmt and data, to write in front of the samples of a PCM stream in
+ *    place of whatever header it came with.
+ *
+ *  - wave_ima_pcm() describes the 16 bit PCM an IMA ADPCM stream
+ *    decodes to, wave_ima_decode() decodes its blocks.
+ *
+ * Sample data is tested in blocks of 64 bytes, with SSE2 where it is
+ * available, and the test stops at the first block that is too loud,
+ * so the cost of classifying an ordinary stream is close to nothing.
+ *
+ * IMA ADPCM is not decoded for that.  Instead a block is considered
+ * silent if its header predictors are quiet, its step indices are
+ * small, and all codes are 0 or 8, i.e. of the smallest magnitude,
+ * which is exactly what encoders produce for digital silence.
+ *
+ * IMA ADPCM blocks of block_align bytes hold the same number of samples
+ * for each channel.  A channel starts with a 4 byte header, the first
+ * sample (int16) and step index (uint8) followed by a reserved byte,
+ * and continues with 4 bit codes, low nibble first:
+ *
+ *   MS IMA:    all headers, then the codes of each channel interleaved
+ *              in words of 4 bytes (8 codes)
+ *   Wwise IMA: for each channel its header and all of its codes; the
+ *              last code is not used, for an even number of samples
+ */
+
+#ifndef WAVE_H_INCLUDED
+#define WAVE_H_INCLUDED
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "riffchunk.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#define WAVE_FORMAT_PCM         0x0001
+#define WAVE_FORMAT_WWISE_IMA   0x0002
+#define WAVE_FORMAT_FLOAT       0x0003
+#define WAVE_FORMAT_IMA_ADPCM   0x0011
+#define WAVE_FORMAT_EXTENSIBLE  0xFFFE
+
+#define WAVE_HEADER_SIZE        44
+
+/* Stops the chunk walk in wave_parse(): */
+#define WAVE_FOUND              2
+
+typedef struct {
+    int endianess;          /* 0: RIFF/RF64, 1: RIFX */
+    unsigned format;        /* format tag, WAVE_FORMAT_EXTENSIBLE resolved */
+    unsigned channels;
+    uint32_t rate;
+    unsigned block_align;
+    unsigned bits;
+    size_t fmt_offs, fmt_len;       /* fmt chunk payload */
+    size_t data_offs, data_len;     /* data chunk payload */
+} wave_t;
+
+static inline int wave_parse_leaf(void *arg, const riffchunk_t *c) {
+    wave_t *w = arg;
+    const uint8_t *p = c->data;
+
+    if (c->depth != 1)
+        return RIFFCHUNK_NEXT;
+    if (!memcmp(c->fcc, "data", 4)) {
+        w->data_offs = c->offs + 8;
+        w->data_len = c->len;
+        return WAVE_FOUND;
+    }
+    if (!memcmp(c->fcc, "fmt ", 4) && c->len >= 16) {
+        w->fmt_offs = c->offs + 8;
+        w->fmt_len = c->len;
+        w->format = riffchunk_u16(p, c->endianess);
+        w->channels = riffchunk_u16(p + 2, c->endianess);
+        w->rate = riffchunk_u32(p + 4, c->endianess);
+        w->block_align = riffchunk_u16(p + 12, c->endianess);
+        w->bits = riffchunk_u16(p + 14, c->endianess);
+        /* The sub format GUID starts with the actual format tag.
+         * Wwise writes a short extensible header without one, for
+         * PCM data: */
+        if (w->format == WAVE_FORMAT_EXTENSIBLE)
+            w->format = c->len >= 40 ? riffchunk_u16(p + 24, c->endianess)
+                                     : WAVE_FORMAT_PCM;
+    }
+    return RIFFCHUNK_NEXT;
+}
+
+/*
+ * Locate the fmt and data chunks of the WAVE stream p of len bytes.
+ * Offsets in w are relative to p, the data chunk is clipped to the end
+ * of the stream.  Returns 0 on success, -1 if either chunk is missing.
+ */
+static inline int wave_parse(wave_t *w, const uint8_t *p, size_t len, int endianess) {
+    riffchunk_visitor_t v = { NULL, NULL, wave_parse_leaf, w };
+
+    memset(w, 0, sizeof *w);
+    w->endianess = endianess;
+    if (len < 12 || memcmp(p + 8, "WAVE", 4))
+        return -1;
+    if (WAVE_FOUND != riffchunk_walk(p, len, &v) || !w->fmt_len)
+        return -1;
+    return 0;
+}
+
+static inline void wave_put(uint8_t *b, uint32_t v, int n) {
+    for (int i = 0; i < n; ++i, v >>= 8)
+        b[i] = v & 0xff;
+}
+
+/*
+ * Build the canonical header for the little endian PCM or float stream
+ * w in h, which must have room for WAVE_HEADER_SIZE bytes.  Odd sized
+ * data must be followed by a padding byte.  Returns 0 on success, -1 if
+ * w cannot be described by such a header.
+ */
+static inline int wave_header(const wave_t *w, uint8_t *h) {
+    size_t len = w->data_len;
+
+    if (w->endianess || !w->channels || !w->block_align || !w->bits
+        || (w->format != WAVE_FORMAT_PCM && w->format != WAVE_FORMAT_FLOAT)
+        || len > 0xFFFFFFFF - (WAVE_HEADER_SIZE - 8) - 1)
+        return -1;
+    memcpy(h, "RIFF", 4);
+    wave_put(h + 4, WAVE_HEADER_SIZE - 8 + len + (len & 1), 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    wave_put(h + 16, 16, 4);
+    wave_put(h + 20, w->format, 2);
+    wave_put(h + 22, w->channels, 2);
+    wave_put(h + 24, w->rate, 4);
+    wave_put(h + 28, w->rate * w->block_align, 4);
+    wave_put(h + 32, w->block_align, 2);
+    wave_put(h + 34, w->bits, 2);
+    memcpy(h + 36, "data", 4);
+    wave_put(h + 40, len, 4);
+    return 0;
+}
+
+/*
+ * Sample kernels: return 1 if none of the n bytes of samples at p
+ * exceeds the threshold, else 0.
+ */
+
+static inline int wave_quiet_s16(const uint8_t *p, size_t n, int be, int thr) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i hi = _mm_set1_epi16((int16_t)thr);
+    const __m128i lo = _mm_set1_epi16((int16_t)-thr);
+    for (; n - i >= 64; i += 64) {
+        __m128i loud = _mm_setzero_si128();
+        for (int k = 0; k < 4; ++k) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(p + i) + k);
+            if (be)
+                x = _mm_or_si128(_mm_slli_epi16(x, 8), _mm_srli_epi16(x, 8));
+            loud = _mm_or_si128(loud, _mm_or_si128(_mm_cmpgt_epi16(x, hi),
+                                                   _mm_cmplt_epi16(x, lo)));
+        }
+        if (_mm_movemask_epi8(loud))
+            return 0;
+    }
+#endif
+    for (; n - i >= 2; i += 2) {
+        int x = (int16_t)riffchunk_u16(p + i, be);
+        if (x > thr || x < -thr)
+            return 0;
+    }
+    return 1;
+}
+
+static inline int wave_quiet_f32(const uint8_t *p, size_t n, int be, float thr) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128 t = _mm_set1_ps(thr);
+    const __m128 abs = _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff));
+    for (; !be && n - i >= 64; i += 64) {
+        __m128 loud = _mm_setzero_ps();
+        for (int k = 0; k < 4; ++k) {
+            __m128 x = _mm_and_ps(_mm_loadu_ps((const float *)(p + i) + 4 * k), abs);
+            loud = _mm_or_ps(loud, _mm_cmpgt_ps(x, t));
+        }
+        if (_mm_movemask_ps(loud))
+            return 0;
+    }
+#endif
+    for (; n - i >= 4; i += 4) {
+        uint32_t u = riffchunk_u32(p + i, be);
+        float x;
+        memcpy(&x, &u, sizeof x);
+        if (x > thr || x < -thr)
+            return 0;
+    }
+    return 1;
+}
+
+static inline int wave_quiet_s24(const uint8_t *p, size_t n, int be, int32_t thr) {
+    for (size_t i = 0; n - i >= 3; i += 3) {
+        const uint8_t *b = p + i;
+        int32_t x = (int32_t)(be ? (uint32_t)b[0] << 24 | b[1] << 16 | b[2] << 8
+                                 : (uint32_t)b[2] << 24 | b[1] << 16 | b[0] << 8) >> 8;
+        if (x > thr || x < -thr)
+            return 0;
+    }
+    return 1;
+}
+
+static inline int wave_quiet_u8(const uint8_t *p, size_t n, int thr) {
+    for (size_t i = 0; i < n; ++i)
+        if (p[i] > 128 + thr || p[i] < 128 - thr)
+            return 0;
+    return 1;
+}
+
+/* Test that all IMA ADPCM codes in n bytes at p are 0 or 8: */
+static inline int wave_quiet_ima_codes(const uint8_t *p, size_t n) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i m = _mm_set1_epi8(0x77);
+    for (; n - i >= 64; i += 64) {
+        const __m128i *v = (const __m128i *)(p + i);
+        __m128i x = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                                 _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+        x = _mm_and_si128(x, m);
+        if (0xffff != _mm_movemask_epi8(_mm_cmpeq_epi8(x, _mm_setzero_si128())))
+            return 0;
+    }
+#endif
+    for (; i < n; ++i)
+        if (p[i] & 0x77)
+            return 0;
+    return 1;
+}
+
+/* Step indices below this have a step size of at most thr / 2: */
+static inline int wave_ima_quiet_index(int thr) {
+    /* The IMA step table is close to 7 * 1.1^i: */
+    int i = 0;
+    for (double step = 7; step * 2 <= thr && i < 88; step *= 1.1)
+        ++i;
+    return i;
+}
+
+/*
+ * Samples per channel in an IMA block and distance of consecutive words
+ * of codes of a channel, or -1 if w is not IMA ADPCM we understand:
+ */
+static inline int wave_ima_layout(const wave_t *w, size_t *spb, size_t *stride) {
+    size_t ba = w->block_align, nch = w->channels;
+
+    if (w->bits != 4 || !nch || ba <= 4 * nch)
+        return -1;
+    if (w->format == WAVE_FORMAT_WWISE_IMA && ba % nch == 0) {
+        *spb = (ba / nch - 4) * 2;
+        *stride = 4;
+    }
+    else if (w->format == WAVE_FORMAT_IMA_ADPCM && (ba - 4 * nch) % (4 * nch) == 0) {
+        *spb = (ba - 4 * nch) * 2 / nch + 1;
+        *stride = 4 * nch;
+    }
+    else
+        return -1;
+    return 0;
+}
+
+/*
+ * Describe the little endian 16 bit PCM the whole blocks of the IMA
+ * ADPCM stream w decode to in pcm.  Returns 0 on success, -1 if w is
+ * not IMA ADPCM we understand.
+ */
+static inline int wave_ima_pcm(const wave_t *w, wave_t *pcm) {
+    size_t spb, stride;
+
+    if (0 != wave_ima_layout(w, &spb, &stride))
+        return -1;
+    *pcm = *w;
+    pcm->endianess = 0;
+    pcm->format = WAVE_FORMAT_PCM;
+    pcm->bits = 16;
+    pcm->block_align = 2 * w->channels;
+    pcm->data_len = w->data_len / w->block_align * spb * pcm->block_align;
+    return 0;
+}
+
+static const int16_t wave_ima_step[89] = {
+    7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37,
+    41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118, 130, 143, 157, 173,
+    190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658,
+    724, 796, 876, 963, 1060, 1166, 1282, 1411, 1552, 1707, 1878, 2066,
+    2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894,
+    6484, 7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289,
+    16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int8_t wave_ima_index[8] = { -1, -1, -1, -1, 2, 4, 6, 8 };
+
+/* Channels of consecutive blocks decoded side by side: */
+#define WAVE_IMA_LANES  16
+
+/*
+ * Decode nblocks blocks of the IMA ADPCM stream w at d into interleaved
+ * native 16 bit samples at out, which must have room for the
+ * nblocks * block samples.  Each block of each channel decodes on its
+ * own, so up to WAVE_IMA_LANES of them are decoded in lockstep:  The
+ * decoder is bound by the latency of the chain of dependent operations
+ * per sample, the independent lanes fill the gaps.  The inner loop is
+ * free of branches, for the compiler to vectorize where it can.
+ */
+static inline void wave_ima_decode(const wave_t *w, const uint8_t *d,
+                                   size_t nblocks, int16_t *out) {
+    const uint8_t *code[WAVE_IMA_LANES];
+    int16_t *dst[WAVE_IMA_LANES];
+    int pred[WAVE_IMA_LANES], idx[WAVE_IMA_LANES];
+    size_t nch = w->channels, ba = w->block_align, total = nblocks * nch;
+    size_t spb, stride, k, s, l, nl;
+
+    if (0 != wave_ima_layout(w, &spb, &stride))
+        return;
+    for (k = 0; k < total; k += nl) {
+        nl = total - k < WAVE_IMA_LANES ? total - k : WAVE_IMA_LANES;
+        for (l = 0; l < nl; ++l) {
+            size_t blk = (k + l) / nch, c = (k + l) % nch;
+            const uint8_t *b = d + blk * ba, *h;
+            if (w->format == WAVE_FORMAT_WWISE_IMA) {
+                h = b + c * (ba / nch);
+                code[l] = h + 4;
+            }
+            else {
+                h = b + 4 * c;
+                code[l] = b + 4 * nch + 4 * c;
+            }
+            pred[l] = (int16_t)riffchunk_u16(h, w->endianess);
+            idx[l] = h[2] > 88 ? 88 : h[2];
+            dst[l] = out + blk * spb * nch + c;
+            dst[l][0] = (int16_t)pred[l];
+        }
+        for (s = 1; s < spb; ++s) {
+            size_t off = ((s - 1) >> 3) * stride + (((s - 1) & 7) >> 1);
+            int sh = ((s - 1) & 1) * 4;
+            for (l = 0; l < nl; ++l) {
+                int n = code[l][off] >> sh & 15;
+                int step = wave_ima_step[idx[l]];
+                int diff = (step >> 3) + (n & 1 ? step >> 2 : 0)
+                           + (n & 2 ? step >> 1 : 0) + (n & 4 ? step : 0);
+                int p = pred[l] + (n & 8 ? -diff : diff);
+                int i = idx[l] + wave_ima_index[n & 7];
+                pred[l] = p < -32768 ? -32768 : p > 32767 ? 32767 : p;
+                idx[l] = i < 0 ? 0 : i > 88 ? 88 : i;
+                dst[l][s * nch] = (int16_t)pred[l];
+            }
+        }
+    }
+}
+
+/* Test the 4 byte IMA block header at h, predictor and step index: */
+static inline int wave_quiet_ima_hdr(const uint8_t *h, int be, int thr, int maxidx) {
+    int x = (int16_t)riffchunk_u16(h, be);
+    return x <= thr && x >= -thr && h[2] < maxidx;
+}
+
+/*
+ * IMA ADPCM.  MS IMA blocks start with one header per channel, followed
+ * by the interleaved codes.  Wwise IMA blocks consist of one sub block
+ * per channel, each a header followed by the codes of that channel.
+ */
+static inline int wave_quiet_ima(const wave_t *w, const uint8_t *p, size_t n, int thr) {
+    size_t ba = w->block_align, nch = w->channels, sub, i, c;
+    int maxidx = wave_ima_quiet_index(thr);
+
+    if (!nch || ba < 4 * nch)
+        return -1;
+    sub = ba / nch;
+    for (i = 0; n - i >= ba; i += ba) {
+        const uint8_t *b = p + i;
+        if (w->format == WAVE_FORMAT_IMA_ADPCM) {
+            for (c = 0; c < nch; ++c)
+                if (!wave_quiet_ima_hdr(b + 4 * c, w->endianess, thr, maxidx))
+                    return 0;
+            if (!wave_quiet_ima_codes(b + 4 * nch, ba - 4 * nch))
+                return 0;
+        }
+        else {
+            for (c = 0; c < nch; ++c)
+                if (!wave_quiet_ima_hdr(b + c * sub, w->endianess, thr, maxidx)
+                    || !wave_quiet_ima_codes(b + c * sub + 4, sub - 4))
+                    return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Tell whether the audio of the WAVE stream p, as described by w, stays
+ * below level, given as a fraction of full scale.  Returns 1 if it is
+ * silent, 0 if not, and -1 for formats we cannot tell.
+ */
+static inline int wave_silent(const wave_t *w, const uint8_t *p, double level) {
+    const uint8_t *d = p + w->data_offs;
+    size_t n = w->data_len;
+    int be = w->endianess;
+
+    switch (w->format) {
+    case WAVE_FORMAT_PCM:
+        if (w->bits <= 8)
+            return wave_quiet_u8(d, n, (int)(level * 128));
+        if (w->bits <= 16)
+            return wave_quiet_s16(d, n, be, (int)(level * 32768));
+        if (w->bits <= 24 && w->block_align == 3 * w->channels)
+            return wave_quiet_s24(d, n, be, (int32_t)(level * 8388608));
+        return -1;
+    case WAVE_FORMAT_FLOAT:
+        return w->bits == 32 ? wave_quiet_f32(d, n, be, (float)level) : -1;
+    case WAVE_FORMAT_WWISE_IMA:
+    case WAVE_FORMAT_IMA_ADPCM:
+        return w->bits == 4 ? wave_quiet_ima(w, d, n, (int)(level * 32768)) : -1;
+    }
+    return -1;
+}
+
+#endif /* WAVE_H_INCLUDED */
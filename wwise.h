@@ -0,0 +1,404 @@
+/*
+ * Copyright 2019 Urban Wallasch <irrwahn35@freenet.de>
+ *
+ * Licensed under the terms of the 0BSD ("Zero-clause BSD") license.
+ * See LICENSE file for details.
+ *
+ * Audiokinetic Wwise metadata helpers.
+ *
+ * Wwise builds ship SoundbanksInfo.{xml,json,txt} files that map numeric
+ * media IDs to the names of the original sound files.  The IDs of the
+ * streams embedded in a file package (AKPK, *.pck) or sound bank (BKHD,
+ * *.bnk) are stored in the respective container's index.
+ *
+ *  - wwnames_load() reads a SoundbanksInfo file into a hash table,
+ *    wwnames_get() looks up the name for a media ID.
+ *
+ *  - wwindex_build() collects the (offset, media ID) pairs from the
+ *    index of a package or bank, wwindex_get() looks up the ID of the
+ *    stream at a given offset.
+ *
+ * The parsers are lenient and only look at the few fields we need.
+ * Layout of the package index (all fields uint32 unless noted, byte
+ * order as indicated by the version field):
+ *
+ *   "AKPK", header size, version, language map size, sound bank LUT
+ *   size, streamed file LUT size [, external file LUT size],
+ *   language map, sound bank LUT, streamed file LUT [, external LUT]
+ *
+ *   Each LUT: entry count, then entries of
+ *     ID (uint64 for externals), block size, file size, start block,
+ *     language ID
+ *
+ * Sound banks consist of sections (fourcc, uint32 size, data); the DIDX
+ * section lists (ID, offset, size) triples of the media stored in the
+ * DATA section, offsets relative to the start of the DATA payload.
+ */
+
+#ifndef WWISE_H_INCLUDED
+#define WWISE_H_INCLUDED
+
+#include <ctype.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Media ID to name hash table:
+ */
+
+typedef struct {
+    uint64_t id;
+    char *name;         /* NULL for an empty slot */
+} wwname_t;
+
+typedef struct {
+    wwname_t *tab;
+    size_t cap;         /* always a power of two */
+    size_t cnt;
+} wwnames_t;
+
+static inline size_t wwnames_hash(uint64_t id, size_t cap) {
+    return (size_t)((id * 0x9e3779b97f4a7c15ULL) >> 17) & (cap - 1);
+}
+
+static inline const char *wwnames_get(const wwnames_t *n, uint64_t id) {
+    size_t i;
+
+    if (!n->cnt)
+        return NULL;
+    for (i = wwnames_hash(id, n->cap); n->tab[i].name; i = (i + 1) & (n->cap - 1))
+        if (n->tab[i].id == id)
+            return n->tab[i].name;
+    return NULL;
+}
+
+/* Insert or replace; takes ownership of name.  Returns -1 on ENOMEM. */
+static inline int wwnames_put(wwnames_t *n, uint64_t id, char *name) {
+    size_t i;
+
+    if (2 * (n->cnt + 1) > n->cap) {
+        wwnames_t t = { NULL, n->cap ? n->cap * 2 : 1024, 0 };
+        t.tab = calloc(t.cap, sizeof *t.tab);
+        if (!t.tab) {
+            free(name);
+            return -1;
+        }
+        for (i = 0; i < n->cap; ++i)
+            if (n->tab[i].name)
+                wwnames_put(&t, n->tab[i].id, n->tab[i].name);
+        free(n->tab);
+        *n = t;
+    }
+    for (i = wwnames_hash(id, n->cap); n->tab[i].name; i = (i + 1) & (n->cap - 1)) {
+        if (n->tab[i].id == id) {
+            free(n->tab[i].name);
+            n->tab[i].name = name;
+            return 0;
+        }
+    }
+    n->tab[i].id = id;
+    n->tab[i].name = name;
+    ++n->cnt;
+    return 0;
+}
+
+static inline void wwnames_free(wwnames_t *n) {
+    for (size_t i = 0; i < n->cap; ++i)
+        free(n->tab[i].name);
+    free(n->tab);
+    memset(n, 0, sizeof *n);
+}
+
+/*
+ * Make a copy of the file name in [b, e) for use as output file name:
+ * strip any directory and extension, and sanitize it like stream labels.
+ */
+static inline char *wwnames_dup(const char *b, const char *e) {
+    const char *p;
+    char *name, *c;
+
+    for (p = b; p < e; ++p)
+        if (*p == '/' || *p == '\\')
+            b = p + 1;
+    for (p = e; p > b; --p)
+        if (p[-1] == '.') {
+            e = p - 1;
+            break;
+        }
+    if (e <= b)
+        return NULL;
+    name = malloc(e - b + 1);
+    if (!name)
+        return NULL;
+    memcpy(name, b, e - b);
+    name[e - b] = '\0';
+    for (c = name; *c; ++c)
+        if (!isprint((unsigned char)*c) || strchr("/\\ ", *c))
+            *c = '_';
+    return name;
+}
+
+/* Is the token tok located at p, delimited by non-alphanumeric chars? */
+static inline int wwnames_tok(const char *txt, const char *p, const char *tok) {
+    size_t l = strlen(tok);
+    return !strncmp(p, tok, l) && !isalnum((unsigned char)p[l])
+            && (p == txt || !isalnum((unsigned char)p[-1]));
+}
+
+/*
+ * Parse SoundbanksInfo.xml or .json text: Every Id attribute or member
+ * is paired with the ShortName element or member following it, e.g.
+ *   <File Id="970242457" ...> ... <ShortName>Foo.wav</ShortName>
+ *   "Id": "970242457", ... "ShortName": "Foo.wav"
+ */
+static inline int wwnames_parse_markup(wwnames_t *n, const char *txt) {
+    const char *p, *v, *e;
+    uint64_t id = 0;
+    int have_id = 0;
+
+    for (p = txt; *p; ++p) {
+        if (*p != 'I' && *p != 'S')
+            continue;
+        if (wwnames_tok(txt, p, "Id")) {
+            for (v = p + 2; *v && strchr("\"'=: \t", *v); ++v)
+                ;
+            if (isdigit((unsigned char)*v)) {
+                id = strtoull(v, (char **)&e, 10);
+                have_id = 1;
+                p = e - 1;
+            }
+        }
+        else if (have_id && wwnames_tok(txt, p, "ShortName")) {
+            for (v = p + 9; *v && strchr("\"'>: \t", *v); ++v)
+                ;
+            for (e = v; *e && !strchr("\"<\r\n", *e); ++e)
+                ;
+            char *name = wwnames_dup(v, e);
+            if (name && 0 != wwnames_put(n, id, name))
+                return -1;
+            have_id = 0;
+            p = e - 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Parse SoundbanksInfo.txt: tab separated tables, lines whose first
+ * non-empty column holds a numeric ID and the second one the name, e.g.
+ *   <TAB>970242457<TAB>Foo<TAB>C:\Sounds\Foo.wav<TAB>...
+ */
+static inline int wwnames_parse_text(wwnames_t *n, char *txt) {
+    char *line, *next, *col[2], *e;
+    int nc;
+
+    for (line = txt; line && *line; line = next) {
+        next = strchr(line, '\n');
+        if (next)
+            *next++ = '\0';
+        for (nc = 0, e = line; nc < 2 && *e; ) {
+            while (*e == '\t')
+                ++e;
+            if (!*e || *e == '\r')
+                break;
+            col[nc++] = e;
+            e += strcspn(e, "\t\r");
+            if (*e)
+                *e++ = '\0';
+        }
+        if (nc < 2 || !isdigit((unsigned char)*col[0]))
+            continue;
+        uint64_t id = strtoull(col[0], &e, 10);
+        if (*e)
+            continue;
+        char *name = wwnames_dup(col[1], col[1] + strlen(col[1]));
+        if (name && 0 != wwnames_put(n, id, name))
+            return -1;
+    }
+    return 0;
+}
+
+/*
+ * Load the SoundbanksInfo file contents txt (null-terminated, modified
+ * in place) into n.  Returns -1 if out of memory.
+ */
+static inline int wwnames_load(wwnames_t *n, char *txt) {
+    const char *p = txt;
+
+    while (isspace((unsigned char)*p))
+        ++p;
+    if (*p == '<' || *p == '{')
+        return wwnames_parse_markup(n, txt);
+    return wwnames_parse_text(n, txt);
+}
+
+
+/*
+ * Stream offset to media ID index:
+ */
+
+typedef struct {
+    size_t offs;        /* offset of the stream in the input file */
+    uint64_t id;        /* its media ID */
+} wwmedia_t;
+
+typedef struct {
+    wwmedia_t *v;
+    size_t cnt, cap;
+    int err;            /* set if we ran out of memory */
+} wwindex_t;
+
+static inline uint32_t wwise_u32(const uint8_t *b, int be) {
+    if (!be)
+        return b[0] | b[1] << 8 | b[2] << 16 | (uint32_t)b[3] << 24;
+    return b[3] | b[2] << 8 | b[1] << 16 | (uint32_t)b[0] << 24;
+}
+
+static inline uint64_t wwise_u64(const uint8_t *b, int be) {
+    uint64_t lo = wwise_u32(b, be), hi = wwise_u32(b + 4, be);
+    return be ? lo << 32 | hi : hi << 32 | lo;
+}
+
+static inline void wwindex_add(wwindex_t *x, size_t offs, uint64_t id) {
+    if (x->cnt == x->cap) {
+        size_t cap = x->cap ? x->cap * 2 : 256;
+        wwmedia_t *t = realloc(x->v, cap * sizeof *t);
+        if (!t) {
+            x->err = 1;
+            return;
+        }
+        x->v = t;
+        x->cap = cap;
+    }
+    x->v[x->cnt].offs = offs;
+    x->v[x->cnt].id = id;
+    ++x->cnt;
+}
+
+/* Index the media of the sound bank located at offset base in buf. */
+static inline void wwindex_bank(wwindex_t *x, const uint8_t *buf, size_t size,
+                                size_t base) {
+    const uint8_t *b = buf + base, *didx = NULL, *data = NULL;
+    size_t rem = size - base, sz, didx_sz = 0, data_sz = 0, i;
+    int be;
+
+    if (rem < 8 || memcmp(b, "BKHD", 4))
+        return;
+    /* The bank header is small, that tells us the byte order: */
+    be = wwise_u32(b + 4, 0) > 0xffff;
+    while (rem >= 8) {
+        sz = wwise_u32(b + 4, be);
+        if (sz > rem - 8)
+            break;
+        if (!memcmp(b, "DIDX", 4)) {
+            didx = b + 8;
+            didx_sz = sz;
+        }
+        else if (!memcmp(b, "DATA", 4)) {
+            data = b + 8;
+            data_sz = sz;
+        }
+        b += 8 + sz;
+        rem -= 8 + sz;
+    }
+    if (!didx || !data)
+        return;
+    for (i = 0; i + 12 <= didx_sz; i += 12) {
+        uint32_t id = wwise_u32(didx + i, be);
+        uint32_t off = wwise_u32(didx + i + 4, be);
+        if (off < data_sz)
+            wwindex_add(x, data - buf + off, id);
+    }
+}
+
+/* Index a file package LUT of n entries starting at p. */
+static inline void wwindex_lut(wwindex_t *x, const uint8_t *buf, size_t size,
+                               const uint8_t *p, size_t lsize, int be, int id64) {
+    size_t esize = id64 ? 24 : 20, cnt, i;
+
+    if (lsize < 4)
+        return;
+    cnt = wwise_u32(p, be);
+    p += 4;
+    for (i = 0; i < cnt && 4 + (i + 1) * esize <= lsize; ++i, p += esize) {
+        uint64_t id = id64 ? wwise_u64(p, be) : wwise_u32(p, be);
+        const uint8_t *q = p + (id64 ? 8 : 4);
+        uint64_t offs = (uint64_t)wwise_u32(q, be) * wwise_u32(q + 8, be);
+        if (offs >= size)
+            continue;
+        wwindex_add(x, offs, id);
+        wwindex_bank(x, buf, size, offs);  /* embedded bank? */
+    }
+}
+
+static inline int wwindex_cmp(const void *a, const void *b) {
+    const wwmedia_t *x = a, *y = b;
+    return (x->offs > y->offs) - (x->offs < y->offs);
+}
+
+/*
+ * Collect the stream offsets and media IDs from the index of the file
+ * package or sound bank in buf.  Returns the number of media found.
+ */
+static inline size_t wwindex_build(wwindex_t *x, const uint8_t *buf, size_t size) {
+    memset(x, 0, sizeof *x);
+    if (size >= 28 && !memcmp(buf, "AKPK", 4)) {
+        int be = wwise_u32(buf + 8, 0) != 1;   /* version is 1 */
+        size_t hsize = wwise_u32(buf + 4, be);
+        size_t lang = wwise_u32(buf + 12, be);
+        size_t banks = wwise_u32(buf + 16, be);
+        size_t stms = wwise_u32(buf + 20, be);
+        size_t exts = wwise_u32(buf + 24, be);
+        size_t tbl = 24;    /* offset of language map */
+
+        /* Newer packages have a fourth LUT for external files: */
+        if (hsize == 4 + 4 * 4 + lang + banks + stms + exts)
+            tbl += 4;
+        else if (hsize != 4 + 3 * 4 + lang + banks + stms)
+            return 0;
+        else
+            exts = 0;
+        if (8 + hsize > size)
+            return 0;
+        tbl += lang;
+        wwindex_lut(x, buf, size, buf + tbl, banks, be, 0);
+        tbl += banks;
+        wwindex_lut(x, buf, size, buf + tbl, stms, be, 0);
+        tbl += stms;
+        wwindex_lut(x, buf, size, buf + tbl, exts, be, 1);
+    }
+    else {
+        wwindex_bank(x, buf, size, 0);
+    }
+    if (x->cnt)
+        qsort(x->v, x->cnt, sizeof *x->v, wwindex_cmp);
+    return x->cnt;
+}
+
+/* Look up the media ID of the stream at offs, returns 0 if unknown. */
+static inline int wwindex_get(const wwindex_t *x, size_t offs, uint64_t *id) {
+    size_t lo = 0, hi = x->cnt, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (x->v[mid].offs < offs)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo < x->cnt && x->v[lo].offs == offs) {
+        *id = x->v[lo].id;
+        return 1;
+    }
+    return 0;
+}
+
+static inline void wwindex_free(wwindex_t *x) {
+    free(x->v);
+    memset(x, 0, sizeof *x);
+}
+
+#endif /* WWISE_H_INCLUDED */